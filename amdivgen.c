@@ -36,7 +36,7 @@
 //  possible in some cases.
 //
 //   This program has been tested in a 64 bits linux using gcc
-//  ("gcc amdivgen.c -o amdivgen").
+//  ("gcc amdivgen.c -o amdivgen -pthread").
 //
 
 
@@ -62,7 +62,7 @@
 //  el código obtenido no es el más rápido posible en algunos casos.
 //
 //   Este programa se ha probado en un linux 64 bits usando gcc
-//  ("gcc amdivgen.c -o amdivgen").
+//  ("gcc amdivgen.c -o amdivgen -pthread").
 //
 
 
@@ -70,17 +70,254 @@
 
 #include "stdio.h"
 #include "stdlib.h"
+#include "string.h"
+#include "time.h"
+#include "pthread.h"
+#include "unistd.h"
 
 #define MAXPOWER2 24
+#define MAXLINES 2048
+#define MAXLABELS 320
+#define MAXTARGETS 6
+#define MAXREPS 65536
+#define MAXREQUESTS 64
+#define MAXPIECES 3
+#define MAXWIDE 1024
+#define MAXSTATES 16384
+#define MAXLEVELS 129
+#define MAXSOURCE 32768
+#define MAXSITES 1024
+#define NUMREGISTERS 13
 
-enum asmLines{ _ld_ba =1, _rra, _srl_a, _add_b, _ret, _and_fc, _and_f8, _and_f0, _and_e0, _and_c0, _and_80, _rlca, _rrca, _rla, _and_01, _and_03, _and_07, _and_0f,_xor_a};
+// Instructions after _xor_a take their operands from resultOp1[] and resultOp2[]:
+//  _ld_r_r: op1=destination, op2=source   _ld_r_n: op1=register, op2=value
+//  _srl_r, _rr_r, _rl_r, _rrc_r, _add_r, _adc_r, _sub_r, _sbc_r, _inc_r, _dec_r, _or_r, _cp_r: op1=register
+//  _add_n, _and_n, _cp_n, _adc_n: op1=value           _add_hl_rr, _sbc_hl_rr: op1=register pair
+//  _ld_rr_nn: op1=register pair, op2=value    _inc_rr, _dec_rr, _push_rr, _pop_rr: op1=register pair
+//  _ld_a_ind, _ld_ind_a: op1=register pair (bc or de)
+//  _bit_r: op1=register, op2=bit               _jr_nc, _jr_c, _jr_z, _jr, _jp, _label: op1=label
+//  _ld_rr_label: op1=register pair, op2=label (its address)
+enum asmLines{ _ld_ba =1, _rra, _srl_a, _add_b, _ret, _and_fc, _and_f8, _and_f0, _and_e0, _and_c0, _and_80, _rlca, _rrca, _rla, _and_01, _and_03, _and_07, _and_0f,_xor_a,
+               _ld_r_r, _ld_r_n, _srl_r, _rr_r, _rl_r, _rrc_r, _bit_r, _add_r, _adc_r, _sub_r, _sbc_r, _inc_r, _dec_r, _or_r, _cp_r, _add_n, _and_n, _cp_n, _adc_n,
+               _ld_rr_nn, _add_hl_rr, _sbc_hl_rr, _inc_rr, _dec_rr, _push_rr, _pop_rr, _ex_de_hl, _neg, _cpl, _ld_a_ind, _ld_ind_a, _jr_nc, _jr_c, _jr_z, _jr, _jp, _jp_hl, _ld_rr_label, _label};
 enum paramregistersUsed{ _only_use_a, _destroys_b};
-int resultLines[50];
+enum z80Registers{ _reg_b, _reg_c, _reg_d, _reg_e, _reg_h, _reg_l, _reg_hl_ind, _reg_a, _reg_ix_ind, _reg_ixh, _reg_ixl, _reg_iyh, _reg_iyl};
+enum z80Pairs{ _pair_bc, _pair_de, _pair_hl};
+enum indexModes{ _index_none, _index_hl, _index_de, _index_page};
+enum flagContracts{ _flag_z=1, _flag_s=2, _flag_nc=4};
+enum resultModes{ _result_hl, _result_saturate, _result_wrap};
+char ixName[16]="(ix+0)";
+char *registerNames[]={"b","c","d","e","h","l","(hl)","a",ixName,"ixh","ixl","iyh","iyl"};
+char *pairNames[]={"bc","de","hl"};
+int resultLines[MAXLINES];
+int resultOp1[MAXLINES];
+int resultOp2[MAXLINES];
 int numResultLines=0;
-int resultLinesTemp[50];
+int resultLinesTemp[MAXLINES];
+int resultOp1Temp[MAXLINES];
+int resultOp2Temp[MAXLINES];
 int numResultLinesTemp=0;
 int sizeResult=0;
 int speedResult=0;
+char labelNames[MAXLABELS][32];
+int numLabels=0;
+
+// Adding the result, multiplied by indexScale, to a base address
+int indexMode=_index_none;
+int indexScale=1;
+int indexWide=0;
+int savedLines[MAXLINES];
+int savedOp1[MAXLINES];
+int savedOp2[MAXLINES];
+int numSavedLines=0;
+
+// Input and output of division and fraction functions (A by default)
+int operandIn=_reg_a;
+int operandOut=_reg_a;
+int ixOffset=0;
+
+// Fraction results rounded to nearest instead of truncated
+int fractionRound=0;
+
+// Result of fractions above 1: 16 bits in HL, 8 bits saturated at 255, or
+// the low 8 bits
+int fractionResult=_result_hl;
+
+// Flags guaranteed on return of division and fraction functions (as a mask of
+// _flag_z: zero set if the result is 0, _flag_s: sign is bit 7 of the result,
+// _flag_nc: carry reset)
+int flagContract=0;
+
+// Registers kept unchanged by division and fraction functions (as a mask of
+// 1<<register), and use of the undocumented IXH, IXL, IYH and IYL registers
+int preserveMask=0;
+int undocumented=0;
+
+// Results computed by a function with multiple results
+float targetNum[MAXTARGETS];
+int targetDiv[MAXTARGETS];
+int targetReg[MAXTARGETS];
+int targetLines[MAXTARGETS][MAXLINES];
+int targetLength[MAXTARGETS];
+int numTargets=0;
+int targetsUseB;
+int registerBusy[NUMREGISTERS];
+int registerDestroyed[NUMREGISTERS];
+int resultInA;
+
+// Requests of a batch, and other names of the routine being printed
+float requestNum[MAXREQUESTS];
+int requestDiv[MAXREQUESTS];
+int requestClass[MAXREQUESTS];
+int numRequests=0;
+char aliasNames[MAXREQUESTS][32];
+int numAliases=0;
+
+// Compare tree over intervals of inputs: interval i starts at treeStart[i]
+// and has treeCount[i] inputs (or their weight). Its leaves are the results
+// of an inverse division (the intervals below treeDivision are replaced by
+// the unrolled division, as the interval treeDivision-1) or the pieces of a
+// split division: the constant treeResult[i], a step from treeResult[i]-1
+// to treeResult[i] at pieceStep[i], or the chain pieceM[i]/2^pieceK[i]
+// plus pieceAdd[i]. Trees are chosen by worst time, or by total time if
+// treeByTotal is set.
+enum treeKinds{ _tree_inverse, _tree_pieces};
+enum pieceKinds{ _piece_constant, _piece_step, _piece_chain};
+int treeKind=_tree_inverse;
+int treeStart[257];
+int treeResult[256];
+long long treeCount[256];
+int treeWorst[256][256];
+long long treeTotal[256][256];
+int treeSplit[256][256];
+int treeNumIntervals;
+int treeDivision;
+int treeByTotal=0;
+int pieceKind[MAXPIECES];
+int pieceStep[MAXPIECES];
+int pieceM[MAXPIECES];
+int pieceK[MAXPIECES];
+int pieceAdd[MAXPIECES];
+
+// Chains of a fraction by a runtime level: levelLines[l] is the code (ending
+// in 'ret') of A * l / 2^k. A chain which is the end of a longer one is
+// entered in the middle of it, at line levelOffset[l] of levelOwner[l], and
+// a chain that fits in an entry of the jump table is placed in the table.
+int levelLines[MAXLEVELS][64];
+int levelOp1[MAXLEVELS][64];
+int levelOp2[MAXLEVELS][64];
+int levelLength[MAXLEVELS];
+int levelSize[MAXLEVELS];
+int levelTime[MAXLEVELS];
+int levelOwner[MAXLEVELS];
+int levelOffset[MAXLEVELS];
+int levelInline[MAXLEVELS];
+int levelLabel[MAXLEVELS];
+int numLevels;
+
+// Lines of an assembly source scanned for calls to the generated functions,
+// split into label, instruction and operands (in lower case, without spaces)
+enum sourceKinds{ _source_empty, _source_code, _source_other};
+enum liveMasks{ _live_flags=1<<8};  // registers are 1<<register
+char sourceText[MAXSOURCE][256];
+char sourceLabel[MAXSOURCE][64];
+char sourceOp[MAXSOURCE][16];
+char sourceArg1[MAXSOURCE][64];
+char sourceArg2[MAXSOURCE][64];
+int sourceKind[MAXSOURCE];
+int numSource;
+
+// Call sites of a source and the variant chosen for each one: the routine
+// (as in requestNum and requestDiv), its operands, flags and preserved
+// registers, and the lines it replaces (the call, and the loading of the
+// input or the use of the result next to it)
+float siteNum[MAXSITES];
+int siteDiv[MAXSITES];
+int siteIn[MAXSITES];
+int siteOut[MAXSITES];
+int siteIx[MAXSITES];
+int siteFlags[MAXSITES];
+int sitePreserve[MAXSITES];
+int siteInline[MAXSITES];
+int siteFirst[MAXSITES];
+int siteCall[MAXSITES];
+int siteLast[MAXSITES];
+int numSites;
+
+// Signed digit representations of a multiplier: digit i is +1 if bit i of
+// repPos is set, and -1 if bit i of repNeg is set
+int repPos[MAXREPS];
+int repNeg[MAXREPS];
+int numReps=0;
+
+// Z80 state used for testing the generated code
+unsigned char z80Reg[8];
+int z80Carry;
+int z80Zero;
+int z80Sign;
+int z80SP=0xBFF0;
+int z80IX=0x9000;
+int z80IY=0x9800;
+int z80Code=0x4000;  // address of the first line of the code
+unsigned char z80Memory[65536];
+
+// Timing statistics of the tested code
+int timeTotal;
+int timeCount;
+int timeWorst;
+int timeBest;
+long long *timeWeights=NULL;  // weight of each input, if it has a profile
+double timeWeighted;
+double timeWeightSum;
+
+// Candidates of findChain16 (HL = DE * wideM[i] / 2^wideS[i]), sorted by
+// cost, and the state shared by the threads verifying them: the next one to
+// verify and the first one found correct
+long long wideM[MAXWIDE];
+int wideS[MAXWIDE];
+int wideStatus[MAXWIDE];  // 0: not verified, 1: correct, 2: wrong
+int numWide;
+long long wideNum;
+long long wideDen;
+long long wideMaxInput;
+int wideNext;
+int wideFound;
+int numThreads=0;  // 0 for one per processor
+pthread_mutex_t wideLock=PTHREAD_MUTEX_INITIALIZER;
+
+// Prefix states: registers A, B and carry (a bit for each input) for all the
+// inputs after running the beginning of a code without jumps. State 0 is the
+// input, and the step from a state through one more line leads to the next
+// one, so candidates of a search beginning with the same lines only run them
+// once. Lines leading to the same registers for all inputs share the state.
+unsigned char stateA[MAXSTATES][256];
+unsigned char stateB[MAXSTATES][256];
+unsigned char stateCarry[MAXSTATES][32];
+int stateSame[MAXSTATES];  // next state with the same hash
+int stateHash[MAXSTATES];
+int numStates=0;
+int stepFrom[MAXSTATES];
+int stepLine[MAXSTATES];
+int stepOp1[MAXSTATES];
+int stepOp2[MAXSTATES];
+int stepTo[MAXSTATES];
+int stepSame[MAXSTATES];  // next step with the same hash
+int stepHash[MAXSTATES];
+int numSteps=0;
+
+// Statistics of the generator itself, collected with --stats
+enum statPhases{ _phase_search, _phase_generate, _phase_optimize, _phase_measure, _phase_test, _num_phases};
+char *phaseNames[]={"search","generate","optimize","measure","test"};
+int statsEnabled=0;
+long long statCandidates=0;
+long long statVerified=0;
+long long statPruned=0;
+long long statCacheHits=0;
+long long statRewrites=0;
+long long phaseCalls[_num_phases];
+int phaseDepth[_num_phases];
+double phaseStart[_num_phases];
+double phaseSeconds[_num_phases];
 
 
 /////////////////////
@@ -101,6 +338,10 @@ void printHelp(void){
   printf("       Creates a routine which multiplies the input value by the fraction\n");
   printf("       num1/num2  (where num2 is a power of 2, and num1<=num2)\n");
   printf("       i.e.:   amdivgen 17 256     creates routine for A = A * (17/256)\n\n");
+  printf(" amdivgen num1 num2 [hl|saturate|wrap]\n");
+  printf("       Fractions above 1 (num1>num2, num1 up to 257) return the result\n");
+  printf("       in HL (default), or in A saturated at 255 or modulo 256\n");
+  printf("       i.e.:   amdivgen 3 2 saturate   creates routine for A = min(255, A * 3/2)\n\n");
   printf(" amdivgen 0 num\n");
   printf("       Shows approximations used to create the division function by a\n");
   printf("       given number\n");
@@ -109,6 +350,119 @@ void printHelp(void){
   printf("       Creates a division function by num, using always approximation\n");
   printf("       by a fraction\n");
   printf("       i.e.:   amdivgen -121       creates routine for A = A / 121\n\n");
+  printf("Options for division and fraction routines:\n");
+  printf(" --index=hl, --index=de\n");
+  printf("       Adds the result to the base address in HL or DE\n");
+  printf(" --index=page\n");
+  printf("       Leaves the result in L, as index into the 256 byte aligned table in H\n");
+  printf(" --scale=n\n");
+  printf("       Multiplies the result by n (1, 2, 4 or 8) before indexing\n");
+  printf("       i.e.:   amdivgen 10 --index=hl --scale=2   HL = HL + 2 * (A / 10)\n");
+  printf(" --in=reg, --out=reg\n");
+  printf("       Reads the input from, or leaves the result in, reg instead of A.\n");
+  printf("       reg can be a, b, c, d, e, h, l, (hl) or (ix+n)\n");
+  printf("       i.e.:   amdivgen 10 --in=c --out=(hl)   (HL) = C / 10\n");
+  printf(" --preserve=regs\n");
+  printf("       Keeps the registers in regs (any of b, c, d, e, h and l) unchanged\n");
+  printf("       (in division, fraction, split, scale and batch routines)\n");
+  printf("       i.e.:   amdivgen 10 --preserve=bc    A = A / 10 without changing BC\n");
+  printf(" --flags=z,s,nc\n");
+  printf("       Guarantees flags on return: z (Z set if the result is 0), s (S is\n");
+  printf("       bit 7 of the result) and nc (carry reset)\n");
+  printf("       i.e.:   amdivgen 10 --flags=z     A = A / 10, Z set if A = 0\n");
+  printf(" --undocumented\n");
+  printf("       Also uses the undocumented IXH, IXL, IYH and IYL registers (here and\n");
+  printf("       in multi routines) when no other register is free\n\n");
+  printf(" amdivgen multi result1 result2 [result3...]\n");
+  printf("       Creates a routine which returns several results at once, sharing\n");
+  printf("       the code they have in common. Each result is a divisor or a\n");
+  printf("       fraction num1/num2, optionally followed by :register (the first\n");
+  printf("       result goes to A, the rest to C, D, E, H and L by default)\n");
+  printf("       It is only created if it is faster than the separate functions\n");
+  printf("       i.e.:   amdivgen multi 3 5:c    creates routine for A = A / 3, C = A / 5\n\n");
+  printf(" amdivgen batch request1 request2 [request3...]\n");
+  printf("       Creates the routines for several divisors or fractions num1/num2.\n");
+  printf("       Requests with the same results for all inputs share one routine,\n");
+  printf("       with a label for each of them\n");
+  printf("       i.e.:   amdivgen batch 3 85.1 85.3 1/4 64/256    creates 3 routines\n\n");
+  printf(" amdivgen divisible num\n");
+  printf("       Creates a routine which tests if A is a multiple of num, returning\n");
+  printf("       the result in the carry flag (zero flag for powers of 2)\n");
+  printf("       i.e.:   amdivgen divisible 6     sets carry if A is a multiple of 6\n\n");
+  printf(" amdivgen multiply num [8|16]\n");
+  printf("       Creates a routine which multiplies A by the integer num, returning\n");
+  printf("       the product in HL (16, default) or its low 8 bits in A (8)\n");
+  printf("       i.e.:   amdivgen multiply 40    creates routine for HL = A * 40\n\n");
+  printf(" amdivgen long num 16|24|32\n");
+  printf("       Creates a routine which divides the 16, 24 or 32-bit number at\n");
+  printf("       (HL) by the integer num, writing the quotient over it\n");
+  printf("       i.e.:   amdivgen long 1000 32   creates routine for (HL) = (HL) / 1000\n\n");
+  printf(" amdivgen scale factor [error]\n");
+  printf("       Creates the fastest routine which multiplies A by a real factor\n");
+  printf("       (up to 1) with an error strictly below the given one (default 1)\n");
+  printf("       for all inputs. An error of 0.5 can't be reached when some A * factor\n");
+  printf("       ends exactly in .5 (like 10 * 0.15)\n");
+  printf("       i.e.:   amdivgen scale 0.7071 0.5    A = A * 0.7071, error below 0.5\n\n");
+  printf(" amdivgen variable maxA minB maxB [mod]\n");
+  printf("       Creates a routine which divides A (0..maxA) by B (minB..maxB),\n");
+  printf("       returning the quotient in A (and the remainder in B if 'mod')\n");
+  printf("       i.e.:   amdivgen variable 255 16 255 mod   A = A / B, B = A mod B\n\n");
+  printf(" amdivgen split num [average [profile]]\n");
+  printf("       Creates a division function by num which splits the inputs in up\n");
+  printf("       to three pieces, each one with its own chain. The split points\n");
+  printf("       give the lowest worst time, or the lowest average time if\n");
+  printf("       'average' is given (with the 256 weights of the inputs read from\n");
+  printf("       the profile file, if any)\n");
+  printf("       i.e.:   amdivgen split 7 average     creates routine for A = A / 7\n\n");
+  printf(" amdivgen inverse num [size]\n");
+  printf("       Creates a routine which divides the constant num (up to 65535) by\n");
+  printf("       A (1 to 255), returning the quotient in A (or HL if num>255). The\n");
+  printf("       fastest routine up to size bytes is chosen, combining a compare\n");
+  printf("       tree with an unrolled division\n");
+  printf("       i.e.:   amdivgen inverse 4096 300   creates routine for HL = 4096 / A\n\n");
+  printf(" amdivgen level num [round]\n");
+  printf("       Creates a routine which multiplies A by C/num, for any level C\n");
+  printf("       from 0 to num (a power of 2 up to 128), jumping to the chain\n");
+  printf("       of the level through a table (rounded to nearest if 'round')\n");
+  printf("       i.e.:   amdivgen level 16     creates routine for A = A * C / 16\n\n");
+  printf(" amdivgen sites file1.s [file2.s...] [rewrite]\n");
+  printf("       Finds the calls to division_by_n and fraction_n_m in assembly\n");
+  printf("       sources and the registers live after them, and creates for each\n");
+  printf("       call the fastest variant (inlined, or taking the input from the\n");
+  printf("       register loaded into A, leaving the result where it is moved,\n");
+  printf("       setting the flags tested next, or keeping the live registers).\n");
+  printf("       Reports the time saved, and changes the sources only if\n");
+  printf("       'rewrite' is given\n");
+  printf("       i.e.:   amdivgen sites game.s     reports the variants for game.s\n\n");
+  printf(" amdivgen carry num\n");
+  printf("       Creates a routine which divides the 9-bit value formed by the\n");
+  printf("       carry flag (bit 8) and A by num\n");
+  printf("       i.e.:   amdivgen carry 5     creates routine for A = (carry:A) / 5\n\n");
+  printf(" amdivgen decimal 8|16 [bcd|ascii]\n");
+  printf("       Creates a routine which converts A (8) or HL (16) to 3 or 5\n");
+  printf("       decimal digits, in packed BCD (default) or written as ASCII\n");
+  printf("       i.e.:   amdivgen decimal 16 ascii   writes HL as 5 digits to (DE)\n\n");
+  printf(" amdivgen fixed num [round]\n");
+  printf("       Creates a routine which divides A by num with 8 fractional bits,\n");
+  printf("       returning the 8.8 fixed point quotient in HL (truncated, or\n");
+  printf("       rounded to nearest if 'round' is given)\n");
+  printf("       i.e.:   amdivgen fixed 3         creates routine for HL = A * 256 / 3\n\n");
+  printf(" amdivgen blend num w1 w2 [w3]\n");
+  printf("       Creates a routine for the exact weighted sum of the inputs\n");
+  printf("       A, B (and C) divided by num (a power of 2)\n");
+  printf("       i.e.:   amdivgen blend 16 5 11    creates routine for A = (A*5 + B*11) / 16\n\n");
+  printf(" amdivgen screen mode [maxX] [hl]\n");
+  printf("       Creates a routine which returns the byte offset (in A, or added\n");
+  printf("       to HL if 'hl' is given) and the pixel mask (in C) of pixel x\n");
+  printf("       (in A if maxX<256, in DE otherwise) in a screen line\n");
+  printf("       i.e.:   amdivgen screen 1 hl    creates routine for mode 1, x=0..319\n\n");
+  printf("Other options:\n");
+  printf(" --stats\n");
+  printf("       Writes the statistics of the search (candidates, time of each\n");
+  printf("       phase, cache hits and optimizations) as JSON to stderr\n");
+  printf(" --threads=n\n");
+  printf("       Number of threads for the searches over 16-bit inputs (one for\n");
+  printf("       each processor by default). The result doesn't depend on it\n\n");
 }
 
 // Prints an array showing the powers of two that composes a given number
@@ -124,6 +478,57 @@ void showPowers(int num) {
   }
 }
 
+// Finds the exact value of a divisor as the fraction *num / *den. The value is
+// the shortest decimal number giving the same float (3.1416 is 31416/10000),
+// so it is the number written by the user.
+void exactDivisor(float n,long long *num,long long *den) {
+  static float lastN=-1;
+  static long long lastNum=1;
+  static long long lastDen=1;
+  char text[32];
+  long long a;
+  long long b;
+  long long t;
+  int decimals=-1;
+  int exponent=0;
+  if ((n==lastN)&&statsEnabled) statCacheHits++;
+  if (n!=lastN) {
+    for (int digits=1;digits<=9;digits++) {
+      sprintf(text,"%.*g",digits,n);
+      if ((float)atof(text)==n) break;
+    }
+    lastNum=0;
+    lastDen=1;
+    for (char *c=text;*c!=0;c++) {
+      if (*c=='.') decimals=0;
+      else if (*c=='e') {
+        exponent=atoi(c+1);
+        break;
+      }
+      else {
+        lastNum=lastNum*10+*c-'0';
+        if (decimals>=0) lastDen*=10;
+      }
+    }
+    for (;exponent>0;exponent--) lastNum*=10;
+    for (;exponent<0;exponent++) lastDen*=10;
+    for (a=lastNum,b=lastDen;b!=0;t=a%b,a=b,b=t);  // reduce the fraction
+    lastNum/=a;
+    lastDen/=a;
+    lastN=n;
+  }
+  *num=lastNum;
+  *den=lastDen;
+}
+
+// Returns the integer quotient j / n, computed exactly
+long long exactQuotient(float n,long long j) {
+  long long num;
+  long long den;
+  exactDivisor(n,&num,&den);
+  return (j*den)/num;
+}
+
 // Prints diferent fraction multiplication approximations for a given divider.
 // Shows test ('OK' or first number that fails) and decompositions.
 void showInfo(float n) {
@@ -131,16 +536,19 @@ void showInfo(float n) {
   int div;
   int value;
   int correct;
+  long long num;
+  long long den;
+  exactDivisor(n,&num,&den);
   printf (" Amdivgen 1.1         Approximations to 1/%g\n",n);
   printf ("     approx        test      decomposition into powers of 2\n",n);
   for (dividerBase2=0;dividerBase2<=MAXPOWER2;dividerBase2++) {
     div=1<<dividerBase2;
     if (n==div) printf("       1/%-8g   OK    %8d:%-2d        1:0\n",n,div,dividerBase2);
-    value=(div/n)+1;
+    value=(div*den)/num+1;
     printf ("%8d/%-8d ",value,div);
     correct=1;
     for (int j=0;j<256;j++){
-      if ( (int)((j*1000)/(n*1000)) != ((value*j)/div) ) {
+      if ( (j*den)/num != ((long long)value*j)/div ) {
         correct=0;
         printf("Err:%-3d ", j);
         j=256;
@@ -153,6 +561,68 @@ void showInfo(float n) {
   }
 }
 
+// Timing statistics of the tested code
+void resetTimes(void) {
+  timeTotal=0;
+  timeCount=0;
+  timeWorst=0;
+  timeBest=1000000;
+  timeWeighted=0;
+  timeWeightSum=0;
+}
+void addTime(int time) {
+  timeTotal+=time;
+  timeCount++;
+  if (time>timeWorst) timeWorst=time;
+  if (time<timeBest) timeBest=time;
+}
+void printTimes(void) {
+  printf(";;         Size: %d bytes\n",sizeResult);
+  printf(";; Average time: %0.2f microseconds\n",timeTotal/(float)timeCount);
+  printf(";;   Worst time: %d microseconds\n",timeWorst);
+  printf(";;    Best time: %d microseconds\n",timeBest);
+  if ((timeWeights!=NULL)&&(timeWeightSum>0)) printf(";; Profile time: %0.2f microseconds (weighted average)\n",timeWeighted/timeWeightSum);
+}
+
+// Returns the wall clock time in seconds
+double wallTime(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC,&now);
+  return now.tv_sec+now.tv_nsec/1e9;
+}
+
+// Start and end of a phase of the generator. Time spent in nested calls of
+// the same phase is only counted once. Nothing is done without --stats.
+void phaseBegin(int phase) {
+  if (!statsEnabled) return;
+  phaseCalls[phase]++;
+  if (phaseDepth[phase]++==0) phaseStart[phase]=wallTime();
+}
+void phaseEnd(int phase) {
+  if (!statsEnabled) return;
+  if (--phaseDepth[phase]==0) phaseSeconds[phase]+=wallTime()-phaseStart[phase];
+}
+
+// Counts a candidate of a search, verified as correct or pruned
+void countCandidate(int correct) {
+  if (!statsEnabled) return;
+  statCandidates++;
+  if (correct) statVerified++;
+  else statPruned++;
+}
+
+// Prints the statistics of the generator as JSON to stderr
+void printStats(void) {
+  fprintf(stderr,"{\n  \"candidates\": { \"generated\": %lld, \"verified\": %lld, \"pruned\": %lld },\n",statCandidates,statVerified,statPruned);
+  fprintf(stderr,"  \"cache_hits\": %lld,\n",statCacheHits);
+  fprintf(stderr,"  \"peephole_rewrites\": %lld,\n",statRewrites);
+  fprintf(stderr,"  \"phases\": {\n");
+  for (int p=0;p<_num_phases;p++) {
+    fprintf(stderr,"    \"%s\": { \"calls\": %lld, \"seconds\": %.6f }%s\n",phaseNames[p],phaseCalls[p],phaseSeconds[p],(p<_num_phases-1)?",":"");
+  }
+  fprintf(stderr,"  }\n}\n");
+}
+
 // Header printing functions
 void printDivisionBy(float num){
   printf(";;\n");
@@ -162,116 +632,431 @@ void printDivisionBy(float num){
   printf(";;\n;;   A = A / %g \n;;\n",num);
 }
 void printMultiplicationBy(float num,int divisor){
+  char *modes[]={"",", saturated at 255",", modulo 256"};
   printf(";;\n");
   printf(";; Multiplication by fraction %d/%d\n",(int)num,divisor);
   printf(";;\n;; Returns the integer part of multiplying\n", num);
-  printf(";; the input value by the fraction %d/%d\n",(int)num,divisor);
-  printf(";;\n;;   A = A * ( %d / %d )\n;;\n",(int)num,divisor);
+  printf(";; the input value by the fraction %d/%d%s\n",(int)num,divisor,(num>divisor)?modes[fractionResult]:"");
+  printf(";;\n;;   %s = A * ( %d / %d )\n;;\n",((num>divisor)&&(fractionResult==_result_hl))?"HL":"A",(int)num,divisor);
 }
 void printCredits(void){
   printf(";;\n;; Function created with Amdivgen 1.1\n");
   printf(";; https://github.com/nestornillo/amdivgen\n;;\n");
 }
+// Prints a list of register names as "A, B and C"
+void printRegisterList(char **names,int numNames) {
+  for (int i=0;i<numNames;i++) {
+    if (i==0) printf("%s",names[i]);
+    else if (i==numNames-1) printf(" and %s",names[i]);
+    else printf(", %s",names[i]);
+  }
+}
+// Marks in written[] the registers changed by the code
+void findWritten(int *written) {
+  for (int r=0;r<NUMREGISTERS;r++) written[r]=0;
+  for (int i=0;i<numResultLines;i++) {
+    switch(resultLines[i]) {
+      case _ld_ba: written[_reg_b]=1; break;
+      case _ld_r_r: case _ld_r_n: case _srl_r: case _rr_r: case _rl_r: case _rrc_r: case _inc_r: case _dec_r:
+        if (resultOp1[i]!=_reg_ix_ind) written[resultOp1[i]]=1;
+        break;
+      case _ld_rr_nn: case _inc_rr: case _dec_rr: case _pop_rr:
+        written[resultOp1[i]*2]=1; written[resultOp1[i]*2+1]=1; break;
+      case _ld_rr_label: written[resultOp1[i]*2]=1; written[resultOp1[i]*2+1]=1; break;
+      case _add_hl_rr: case _sbc_hl_rr: written[_reg_h]=1; written[_reg_l]=1; break;
+      case _ex_de_hl: written[_reg_d]=1; written[_reg_e]=1; written[_reg_h]=1; written[_reg_l]=1; break;
+      case _ret: case _label: case _jr_nc: case _jr_c: case _jr_z: case _jr: case _jp: case _jp_hl: case _bit_r: case _cp_n: case _cp_r: case _push_rr: case _ld_ind_a: break;
+      default: written[_reg_a]=1;
+    }
+  }
+  written[_reg_hl_ind]=0;
+}
+
+// Prints the registers changed by the code, except the outputs (as a mask
+// of 1<<register)
+void printDestroyed(int outputs) {
+  char *names[NUMREGISTERS]={"B","C","D","E","H","L","","A","","IXH","IXL","IYH","IYL"};
+  char *list[NUMREGISTERS];
+  int numNames=0;
+  int written[NUMREGISTERS];
+  findWritten(written);
+  if (written[_reg_a]&&!((outputs>>_reg_a)&1)) list[numNames++]=names[_reg_a];
+  for (int r=_reg_b;r<NUMREGISTERS;r++) {
+    if ((r==_reg_hl_ind)||(r==_reg_a)||(r==_reg_ix_ind)) continue;
+    if (written[r]&&!((outputs>>r)&1)) list[numNames++]=names[r];
+  }
+  if (numNames>0) {
+    printf(";;\n;; Destroys ");
+    printRegisterList(list,numNames);
+    printf(" register%s\n",numNames>1?"s":"");
+  }
+}
+
+// Returns the description of an input or output location
+char *operandText(int reg) {
+  static char text[32];
+  if (reg==_reg_hl_ind) return "memory at (HL)";
+  if (reg==_reg_ix_ind) {
+    sprintf(text,"memory at (IX%+d)",ixOffset);
+    return text;
+  }
+  sprintf(text,"%c register",registerNames[reg][0]-'a'+'A');
+  return text;
+}
+// Prints the flags guaranteed on return
+void printFlags(void) {
+  char *names[3];
+  int numNames=0;
+  if (flagContract&_flag_z) names[numNames++]="Z set if the result is 0";
+  if (flagContract&_flag_s) names[numNames++]="S = bit 7 of the result";
+  if (flagContract&_flag_nc) names[numNames++]="carry reset";
+  if (numNames==0) return;
+  printf(";;   Flags: ");
+  printRegisterList(names,numNames);
+  printf("\n");
+}
+// Prints input, output and destroyed registers of division and fraction functions
+void printRegisters(int registers) {
+  char *destroyed[5];
+  int numDestroyed=0;
+  if ((operandIn!=_reg_a)||(operandOut!=_reg_a)||(preserveMask!=0)) {
+    printf(";;   Input: %s\n",operandText(operandIn));
+    printf(";;  Output: %s\n",operandText(operandOut));
+    printFlags();
+    printDestroyed(((operandOut<_reg_hl_ind)||(operandOut==_reg_a)?1<<operandOut:0)|preserveMask);
+    return;
+  }
+  printf(";;   Input: A register\n");
+  if (indexMode==_index_none) printf(";;  Output: A register\n");
+  else if (indexMode==_index_page) printf(";;  Output: L register (H:L points to element %d * result of the aligned table at H)\n",indexScale);
+  else if (indexScale==1) printf(";;  Output: %s register (%s + result)\n",indexMode==_index_hl?"HL":"DE",indexMode==_index_hl?"HL":"DE");
+  else printf(";;  Output: %s register (%s + %d * result)\n",indexMode==_index_hl?"HL":"DE",indexMode==_index_hl?"HL":"DE",indexScale);
+  printFlags();
+  if ((indexMode==_index_hl)||(indexMode==_index_de)) destroyed[numDestroyed++]="A";
+  if (registers==_destroys_b) destroyed[numDestroyed++]="B";
+  if (indexWide&&(indexMode==_index_hl)) { destroyed[numDestroyed++]="D"; destroyed[numDestroyed++]="E"; }
+  if (indexWide&&(indexMode==_index_de)) { destroyed[numDestroyed++]="H"; destroyed[numDestroyed++]="L"; }
+  if (numDestroyed>0) {
+    printf(";;\n;; Destroys ");
+    printRegisterList(destroyed,numDestroyed);
+    printf(numDestroyed>1?" registers\n":" register\n");
+  }
+}
+// Writes in text the suffix added to function names when the result is used as
+// an index, or is read or written somewhere else
+void indexSuffix(char *text) {
+  char *names[]={"b","c","d","e","h","l","mhl","a"};
+  text[0]=0;
+  if (operandIn!=_reg_a) {
+    if (operandIn==_reg_ix_ind) sprintf(text+strlen(text),"_from_ix%s%d",ixOffset<0?"m":"",ixOffset<0?-ixOffset:ixOffset);
+    else sprintf(text+strlen(text),"_from_%s",names[operandIn]);
+  }
+  if (operandOut!=_reg_a) {
+    if (operandOut==_reg_ix_ind) sprintf(text+strlen(text),"_to_ix%s%d",ixOffset<0?"m":"",ixOffset<0?-ixOffset:ixOffset);
+    else sprintf(text+strlen(text),"_to_%s",names[operandOut]);
+  }
+  if (flagContract!=0) {
+    strcat(text,"_flags");
+    if (flagContract&_flag_z) strcat(text,"_z");
+    if (flagContract&_flag_s) strcat(text,"_s");
+    if (flagContract&_flag_nc) strcat(text,"_nc");
+  }
+  if (preserveMask!=0) {
+    strcat(text,"_keep_");
+    for (int r=_reg_b;r<=_reg_l;r++) if ((preserveMask>>r)&1) strcat(text,names[r]);
+  }
+  if (indexMode==_index_none) return;
+  sprintf(text+strlen(text),"_%s",indexMode==_index_hl?"hl":(indexMode==_index_de?"de":"page"));
+  if (indexScale>1) sprintf(text+strlen(text),"_x%d",indexScale);
+}
+void printIndexSuffix(void) {
+  char text[64];
+  indexSuffix(text);
+  printf("%s",text);
+}
+// Prints the other labels of the function
+void printAliases(void) {
+  for (int i=0;i<numAliases;i++) {
+    printf("%s",aliasNames[i]);
+    printIndexSuffix();
+    printf("::\n");
+  }
+}
 void printHeaderNumberBigger85Smaller128(float num) {
-  int doublenum;
-  doublenum=num*2;
-  if (num!=(int)num) doublenum++;
   printDivisionBy(num);
-  printf(";;   Input: A register\n;;  Output: A register\n;;\n");
-  printf(";;         Size: 12 bytes\n");
-  printf(";; Average time: %0.2f microseconds\n",(doublenum/(float)256)+10);
-  printf(";;   Worst time: 11 microseconds\n");
-  printf(";;    Best time: 10 microseconds\n");
+  printRegisters(_only_use_a);
+  printf(";;\n");
+  printTimes();
   printCredits();
-  printf("division_by_%g::\n", num);
+  printf("division_by_%g", num);
+  printIndexSuffix();
+  printf("::\n");
+  printAliases();
 }
 void printHeader(float num,int size,int speed,int registers,int divisor) {
-  if (divisor!=0) {
+  char *modes[]={"_hl","_saturate","_wrap"};
+  if ((divisor!=0)&&(num>divisor)) {
     printMultiplicationBy(num,divisor);
-    printf(";;   Input: A register\n;;  Output: A register\n");
-    if (registers==_destroys_b) printf(";;\n;; Destroys B register\n");
+    printf(";;   Input: A register\n");
+    printf(";;  Output: %s\n",(fractionResult==_result_hl)?"HL registers":"A register");
+    printFlags();
+    printDestroyed(((fractionResult==_result_hl)?(1<<_reg_h)|(1<<_reg_l):1<<_reg_a)|preserveMask);
     printf(";;\n;; %d bytes / %d microseconds\n",size,speed);
     printCredits();
-    printf("fraction_%d_%d::\n", (int)num,divisor);
+    printf("fraction_%d_%d%s", (int)num,divisor,modes[fractionResult]);
+  }
+  else if (divisor!=0) {
+    printMultiplicationBy(num,divisor);
+    printRegisters(registers);
+    printf(";;\n;; %d bytes / %d microseconds\n",size,speed);
+    printCredits();
+    printf("fraction_%d_%d", (int)num,divisor);
   }
   else {
     printDivisionBy(num);
-    printf(";;   Input: A register\n;;  Output: A register\n");
-    if (registers==_destroys_b) printf(";;\n;; Destroys B register\n");
+    printRegisters(registers);
     printf(";;\n;; %d bytes / %d microseconds\n",size,speed);
     printCredits();
-    printf("division_by_%g::\n", num);
+    printf("division_by_%g", num);
   }
+  printIndexSuffix();
+  printf("::\n");
+  printAliases();
 }
 
-// Code printing function
-void printlines(void) {
+// Returns 1 if reg is one of the undocumented halves of IX and IY
+int isHalfRegister(int reg) {
+  return (reg>=_reg_ixh)&&(reg<=_reg_iyl);
+}
+
+// Returns 1 if a line uses a half of IX or IY, which adds a prefix byte
+int usesHalfRegister(int line) {
+  if ((resultLines[line]<_ld_r_r)||(resultLines[line]>_cp_r)) return 0;
+  return isHalfRegister(resultOp1[line])||((resultLines[line]==_ld_r_r)&&isHalfRegister(resultOp2[line]));
+}
+
+// Returns the size in bytes of one line of code
+int lineSize(int line) {
+  int index;
+  int half;
+  int value=(resultLines[line]==_ld_r_n)||(resultLines[line]==_bit_r);  // op2 is not a register
+  index=(resultOp1[line]==_reg_ix_ind)||(!value&&(resultOp2[line]==_reg_ix_ind));
+  half=usesHalfRegister(line);
+  switch(resultLines[line]){
+    case _label:
+      return 0;
+    case _ret: case _ld_ba: case _rra: case _add_b: case _rlca: case _rrca: case _rla: case _xor_a: case _add_hl_rr: case _ex_de_hl: case _cpl:
+    case _inc_rr: case _dec_rr: case _push_rr: case _pop_rr: case _ld_a_ind: case _ld_ind_a: case _jp_hl:
+      return 1;
+    case _ld_r_r: case _add_r: case _adc_r: case _sub_r: case _sbc_r: case _inc_r: case _dec_r: case _or_r: case _cp_r:
+      return 1+index*2+half;  // (ix+d) adds a prefix and the displacement
+    case _srl_a: case _and_fc: case _and_f8: case _and_f0: case _and_e0: case _and_c0: case _and_80: case _and_01: case _and_03: case _and_07: case _and_0f:
+    case _add_n: case _and_n: case _cp_n: case _adc_n: case _jr_nc: case _jr_c: case _jr_z: case _jr:
+      return 2;
+    case _ld_r_n: case _srl_r: case _rr_r: case _rl_r: case _rrc_r: case _bit_r:
+      return 2+index*2+half;
+    case _ld_rr_nn: case _ld_rr_label: case _jp:
+      return 3;
+    case _neg: case _sbc_hl_rr:
+      return 2;
+    default:
+      printf(";;---ERROR lineSize---\n");
+  }
+  return 0;
+}
+
+// Returns the time in microseconds of one line of code (conditional jumps not taken)
+int lineTime(int line) {
+  int memory;
+  int index;
+  int half;
+  int value=(resultLines[line]==_ld_r_n)||(resultLines[line]==_bit_r);  // op2 is not a register
+  memory=(resultOp1[line]==_reg_hl_ind)||(!value&&(resultOp2[line]==_reg_hl_ind));
+  index=(resultOp1[line]==_reg_ix_ind)||(!value&&(resultOp2[line]==_reg_ix_ind));
+  half=usesHalfRegister(line);
+  switch(resultLines[line]){
+    case _label:
+      return 0;
+    case _ret:
+      return 3;
+    case _ld_ba: case _rra: case _add_b: case _rlca: case _rrca: case _rla: case _xor_a: case _ex_de_hl: case _cpl: case _jp_hl:
+      return 1;
+    case _srl_a: case _and_fc: case _and_f8: case _and_f0: case _and_e0: case _and_c0: case _and_80: case _and_01: case _and_03: case _and_07: case _and_0f:
+    case _add_n: case _and_n: case _cp_n: case _adc_n: case _jr_nc: case _jr_c: case _jr_z:
+      return 2;
+    case _add_hl_rr: case _ld_rr_nn: case _ld_rr_label: case _pop_rr: case _jr: case _jp:
+      return 3;
+    case _inc_rr: case _dec_rr: case _neg: case _ld_a_ind: case _ld_ind_a:
+      return 2;
+    case _sbc_hl_rr:
+      return 4;
+    case _push_rr:
+      return 4;
+    case _ld_r_r: case _add_r: case _adc_r: case _sub_r: case _sbc_r: case _or_r: case _cp_r:
+      return 1+memory+index*4+half;
+    case _inc_r: case _dec_r:
+      return 1+memory*2+index*5+half;
+    case _ld_r_n: case _bit_r:
+      return 2+memory+index*4+half;
+    case _srl_r: case _rr_r: case _rl_r: case _rrc_r:
+      return 2+memory*2+index*5;
+    default:
+      printf(";;---ERROR lineTime---\n");
+  }
+  return 0;
+}
+
+// Code printing function, writing each line after indent
+void writeLines(FILE *file,char *indent) {
+  char text[48];
   for (int i=0;i<numResultLines;i++) {
     switch(resultLines[i]){
-      case _ld_ba: printf("ld b,a    ; [1]\n"); break;
-      case _rra:   printf("rra       ; [1]\n"); break;
-      case _srl_a: printf("srl a     ; [2]\n"); break;
-      case _add_b: printf("add b     ; [1]\n"); break;
-      case _ret:   printf("ret       ; [3]\n"); break;
-      case _and_fc:printf("and #0xFC ; [2]\n"); break;
-      case _and_f8:printf("and #0xF8 ; [2]\n"); break;
-      case _and_f0:printf("and #0xF0 ; [2]\n"); break;
-      case _and_e0:printf("and #0xE0 ; [2]\n"); break;
-      case _and_c0:printf("and #0xC0 ; [2]\n"); break;
-      case _and_80:printf("and #0x80 ; [2]\n"); break;
-      case _rlca:  printf("rlca      ; [1]\n"); break;
-      case _rrca:  printf("rrca      ; [1]\n"); break;
-      case _rla:   printf("rla       ; [1]\n"); break;
-      case _and_01:printf("and #0x01 ; [2]\n"); break;
-      case _and_03:printf("and #0x03 ; [2]\n"); break;
-      case _and_07:printf("and #0x07 ; [2]\n"); break;
-      case _and_0f:printf("and #0x0F ; [2]\n"); break;
-      case _xor_a :printf("xor a     ; [1]\n"); break;
-      default:  printf(";;---ERROR printlines---\n");
+      case _ld_r_r: sprintf(text,"ld %s,%s",registerNames[resultOp1[i]],registerNames[resultOp2[i]]); break;
+      case _ld_r_n:
+        if (resultOp2[i]<10) sprintf(text,"ld %s,#%d",registerNames[resultOp1[i]],resultOp2[i]);
+        else sprintf(text,"ld %s,#0x%02X",registerNames[resultOp1[i]],resultOp2[i]);
+        break;
+      case _srl_r:  sprintf(text,"srl %s",registerNames[resultOp1[i]]); break;
+      case _rr_r:   sprintf(text,"rr %s",registerNames[resultOp1[i]]); break;
+      case _rl_r:   sprintf(text,"rl %s",registerNames[resultOp1[i]]); break;
+      case _rrc_r:  sprintf(text,"rrc %s",registerNames[resultOp1[i]]); break;
+      case _bit_r:  sprintf(text,"bit %d,%s",resultOp2[i],registerNames[resultOp1[i]]); break;
+      case _add_r:  sprintf(text,"add %s",registerNames[resultOp1[i]]); break;
+      case _adc_r:  sprintf(text,"adc %s",registerNames[resultOp1[i]]); break;
+      case _sub_r:  sprintf(text,"sub %s",registerNames[resultOp1[i]]); break;
+      case _sbc_r:  sprintf(text,"sbc %s",registerNames[resultOp1[i]]); break;
+      case _inc_r:  sprintf(text,"inc %s",registerNames[resultOp1[i]]); break;
+      case _dec_r:  sprintf(text,"dec %s",registerNames[resultOp1[i]]); break;
+      case _or_r:   sprintf(text,"or %s",registerNames[resultOp1[i]]); break;
+      case _cp_r:   sprintf(text,"cp %s",registerNames[resultOp1[i]]); break;
+      case _add_n:  sprintf(text,"add #%d",resultOp1[i]); break;
+      case _and_n:  sprintf(text,"and #0x%02X",resultOp1[i]); break;
+      case _cp_n:   sprintf(text,"cp #%d",resultOp1[i]); break;
+      case _adc_n:  sprintf(text,"adc #%d",resultOp1[i]); break;
+      case _add_hl_rr: sprintf(text,"add hl,%s",pairNames[resultOp1[i]]); break;
+      case _sbc_hl_rr: sprintf(text,"sbc hl,%s",pairNames[resultOp1[i]]); break;
+      case _ld_rr_nn: sprintf(text,"ld %s,#%d",pairNames[resultOp1[i]],resultOp2[i]); break;
+      case _ld_rr_label: sprintf(text,"ld %s,#%s",pairNames[resultOp1[i]],labelNames[resultOp2[i]]); break;
+      case _jr: sprintf(text,"jr %s",labelNames[resultOp1[i]]); break;
+      case _jp: sprintf(text,"jp %s",labelNames[resultOp1[i]]); break;
+      case _jp_hl: sprintf(text,"jp (hl)"); break;
+      case _ex_de_hl: sprintf(text,"ex de,hl"); break;
+      case _inc_rr: sprintf(text,"inc %s",pairNames[resultOp1[i]]); break;
+      case _dec_rr: sprintf(text,"dec %s",pairNames[resultOp1[i]]); break;
+      case _ld_a_ind: sprintf(text,"ld a,(%s)",pairNames[resultOp1[i]]); break;
+      case _ld_ind_a: sprintf(text,"ld (%s),a",pairNames[resultOp1[i]]); break;
+      case _push_rr: sprintf(text,"push %s",pairNames[resultOp1[i]]); break;
+      case _pop_rr: sprintf(text,"pop %s",pairNames[resultOp1[i]]); break;
+      case _neg: sprintf(text,"neg"); break;
+      case _cpl: sprintf(text,"cpl"); break;
+      case _jr_nc:  fprintf(file,"%sjr nc,%s ; [2/3]\n",indent,labelNames[resultOp1[i]]); continue;
+      case _jr_c:   fprintf(file,"%sjr c,%s ; [2/3]\n",indent,labelNames[resultOp1[i]]); continue;
+      case _jr_z:   fprintf(file,"%sjr z,%s ; [2/3]\n",indent,labelNames[resultOp1[i]]); continue;
+      case _label:  fprintf(file,"%s%s:\n",indent,labelNames[resultOp1[i]]); continue;
+      default: text[0]=0;
+    }
+    if (text[0]!=0) {
+      fprintf(file,"%s%-9s ; [%d]\n",indent,text,lineTime(i));
+      continue;
+    }
+    switch(resultLines[i]){
+      case _ld_ba: fprintf(file,"%sld b,a    ; [1]\n",indent); break;
+      case _rra:   fprintf(file,"%srra       ; [1]\n",indent); break;
+      case _srl_a: fprintf(file,"%ssrl a     ; [2]\n",indent); break;
+      case _add_b: fprintf(file,"%sadd b     ; [1]\n",indent); break;
+      case _ret:   fprintf(file,"%sret       ; [3]\n",indent); break;
+      case _and_fc:fprintf(file,"%sand #0xFC ; [2]\n",indent); break;
+      case _and_f8:fprintf(file,"%sand #0xF8 ; [2]\n",indent); break;
+      case _and_f0:fprintf(file,"%sand #0xF0 ; [2]\n",indent); break;
+      case _and_e0:fprintf(file,"%sand #0xE0 ; [2]\n",indent); break;
+      case _and_c0:fprintf(file,"%sand #0xC0 ; [2]\n",indent); break;
+      case _and_80:fprintf(file,"%sand #0x80 ; [2]\n",indent); break;
+      case _rlca:  fprintf(file,"%srlca      ; [1]\n",indent); break;
+      case _rrca:  fprintf(file,"%srrca      ; [1]\n",indent); break;
+      case _rla:   fprintf(file,"%srla       ; [1]\n",indent); break;
+      case _and_01:fprintf(file,"%sand #0x01 ; [2]\n",indent); break;
+      case _and_03:fprintf(file,"%sand #0x03 ; [2]\n",indent); break;
+      case _and_07:fprintf(file,"%sand #0x07 ; [2]\n",indent); break;
+      case _and_0f:fprintf(file,"%sand #0x0F ; [2]\n",indent); break;
+      case _xor_a :fprintf(file,"%sxor a     ; [1]\n",indent); break;
+      default:  fprintf(file,"%s;;---ERROR printlines---\n",indent);
     }
   }
 }
+void printlines(void) {
+  writeLines(stdout,"");
+}
 
 
 ////////////////////////////
 // CODE GENERATION FUNCTIONS
 ////////////////////////////
 
-// Add one instruction to the code
-void addLine(int asmInstruction) {
+// Start a new function
+void resetCode(void) {
+  numResultLines=0;
+  numLabels=0;
+}
+
+// Add one instruction with operands to the code
+void addLineOp(int asmInstruction,int op1,int op2) {
   resultLines[numResultLines]=asmInstruction;
+  resultOp1[numResultLines]=op1;
+  resultOp2[numResultLines]=op2;
   numResultLines++;
 }
 
+// Add one instruction to the code
+void addLine(int asmInstruction) {
+  addLineOp(asmInstruction,0,0);
+}
+
 // Add one instruction to temp code
 void addLineTemp(int asmInstruction) {
   resultLinesTemp[numResultLinesTemp]=asmInstruction;
+  resultOp1Temp[numResultLinesTemp]=0;
+  resultOp2Temp[numResultLinesTemp]=0;
   numResultLinesTemp++;
 }
 
+// Creates a new label. Without a name, a local label (n$) is used
+int newLabel(char *name) {
+  if (name==NULL) sprintf(labelNames[numLabels],"%d$",numLabels+1);
+  else sprintf(labelNames[numLabels],"%s",name);
+  numLabels++;
+  return numLabels-1;
+}
+
 
 // measure size and speed of generated code
 void measureCode(void) {
+  phaseBegin(_phase_measure);
   sizeResult=0;
   speedResult=0;
   for (int i=0;i<numResultLines;i++) {
-    switch(resultLines[i]){
-      case _ret:
-      sizeResult+=1; speedResult+=3; break;
-      case _ld_ba: case _rra: case _add_b: case _rlca: case _rrca: case _rla: case _xor_a:
-      sizeResult+=1; speedResult+=1; break;
-      case _srl_a: case _and_fc: case _and_f8: case _and_f0: case _and_e0: case _and_c0: case _and_80: case _and_01: case _and_03: case _and_07: case _and_0f:
-      sizeResult+=2; speedResult+=2; break;
-      default:
-      printf(";;---ERROR measureCode---\n");
-    }
+    sizeResult+=lineSize(i);
+    speedResult+=lineTime(i);
+  }
+  phaseEnd(_phase_measure);
+}
+
+// Returns the time of the lines from start to the end of the code, leaving
+// their size in *size. Used to compare candidates appended to the code.
+int measureFrom(int start,int *size) {
+  int time=0;
+  *size=0;
+  for (int i=start;i<numResultLines;i++) {
+    *size+=lineSize(i);
+    time+=lineTime(i);
   }
+  return time;
 }
 
 // Optimize function by changing consecutive srla to a more compact equivalent form
 void optimizeCode(void) {
   int srlaInARow;
   int modnextline;
+  phaseBegin(_phase_optimize);
   numResultLinesTemp=0;
   for (int i=0;i<numResultLines;i++) {
     srlaInARow=0;
@@ -294,6 +1079,13 @@ void optimizeCode(void) {
         for (int j=i;resultLines[j]==_srl_a;j++) {
           srlaInARow++;// count srlas
         }
+        if (flagContract&&(srlaInARow>=3)&&(srlaInARow<=7)) { // same cost, but the mask goes last and sets the flags
+          for (int j=0;j<((srlaInARow<=4)?srlaInARow:8-srlaInARow);j++) addLineTemp((srlaInARow<=4)?_rrca:_rlca);
+          addLineTemp(_and_n);
+          resultOp1Temp[numResultLinesTemp-1]=0xFF>>srlaInARow;
+          modnextline=srlaInARow-1;
+          break;
+        }
         switch(srlaInARow) { // optimizations for n srla
           case 3: addLineTemp(_and_f8);addLineTemp(_rrca);addLineTemp(_rrca);addLineTemp(_rrca);modnextline=2;break;
           case 4: addLineTemp(_and_f0);addLineTemp(_rrca);addLineTemp(_rrca);addLineTemp(_rrca);addLineTemp(_rrca);modnextline=3;break;
@@ -307,17 +1099,697 @@ void optimizeCode(void) {
         break;
       default:
         addLineTemp(resultLines[i]);
+        resultOp1Temp[numResultLinesTemp-1]=resultOp1[i];
+        resultOp2Temp[numResultLinesTemp-1]=resultOp2[i];
     }
+    if ((modnextline>0)&&statsEnabled) statRewrites++;
     i+=modnextline; // skip substituted lines
   }
   numResultLines=0; // reset result counter
   for (int i=0;i<numResultLinesTemp;i++) {
-    addLine(resultLinesTemp[i]); // copy temp to result
+    addLineOp(resultLinesTemp[i],resultOp1Temp[i],resultOp2Temp[i]); // copy temp to result
   }
+  phaseEnd(_phase_optimize);
 }
 
-// Create code for a multiplication by a fraction
-void generateCode(float num,int i,int div,int divpow) {
+
+////////////////////
+// TESTING FUNCTIONS
+////////////////////
+
+// Read and write a register (or the memory pointed by HL or IX)
+int z80Get(int reg) {
+  if (reg==_reg_hl_ind) return z80Memory[z80Reg[_reg_h]*256+z80Reg[_reg_l]];
+  if (reg==_reg_ix_ind) return z80Memory[(z80IX+ixOffset)&0xFFFF];
+  if (reg==_reg_ixh) return (z80IX>>8)&255;
+  if (reg==_reg_ixl) return z80IX&255;
+  if (reg==_reg_iyh) return (z80IY>>8)&255;
+  if (reg==_reg_iyl) return z80IY&255;
+  return z80Reg[reg];
+}
+void z80Set(int reg,int value) {
+  if (reg==_reg_hl_ind) z80Memory[z80Reg[_reg_h]*256+z80Reg[_reg_l]]=value&255;
+  else if (reg==_reg_ix_ind) z80Memory[(z80IX+ixOffset)&0xFFFF]=value&255;
+  else if (reg==_reg_ixh) z80IX=(z80IX&0xFF)|((value&255)<<8);
+  else if (reg==_reg_ixl) z80IX=(z80IX&0xFF00)|(value&255);
+  else if (reg==_reg_iyh) z80IY=(z80IY&0xFF)|((value&255)<<8);
+  else if (reg==_reg_iyl) z80IY=(z80IY&0xFF00)|(value&255);
+  else z80Reg[reg]=value&255;
+}
+
+// Update zero and sign flags from a result
+void z80Flags(int value) {
+  z80Zero=((value&255)==0);
+  z80Sign=((value&128)!=0);
+}
+
+// Returns the line where a label is placed
+int findLabel(int label) {
+  for (int i=0;i<numResultLines;i++) {
+    if ((resultLines[i]==_label)&&(resultOp1[i]==label)) return i;
+  }
+  printf(";;---ERROR findLabel---\n");
+  return numResultLines;
+}
+
+// Returns the address of a line, with the code placed at z80Code
+int lineAddress(int line) {
+  int address=z80Code;
+  for (int i=0;i<line;i++) address+=lineSize(i);
+  return address;
+}
+
+// Returns the first line placed at an address
+int findAddress(int address) {
+  int here=z80Code;
+  for (int i=0;i<numResultLines;i++) {
+    if (here==address) return i;
+    here+=lineSize(i);
+  }
+  printf(";;---ERROR findAddress---\n");
+  return numResultLines;
+}
+
+// Runs one line of the generated code on the current Z80 state. Returns the
+// next line (adding 1 to *time for taken jumps), or -1 after 'ret'.
+int runLine(int i,int *time) {
+  int value;
+  switch(resultLines[i]){
+    case _ret: return -1;
+    case _label: break;
+    case _ld_ba: z80Reg[_reg_b]=z80Reg[_reg_a]; break;
+    case _rra: value=z80Reg[_reg_a]|(z80Carry<<8); z80Carry=value&1; z80Reg[_reg_a]=value>>1; break;
+    case _rla: value=(z80Reg[_reg_a]<<1)|z80Carry; z80Carry=value>>8; z80Reg[_reg_a]=value; break;
+    case _rrca: z80Carry=z80Reg[_reg_a]&1; z80Reg[_reg_a]=(z80Reg[_reg_a]>>1)|(z80Carry<<7); break;
+    case _rlca: z80Carry=z80Reg[_reg_a]>>7; z80Reg[_reg_a]=(z80Reg[_reg_a]<<1)|z80Carry; break;
+    case _srl_a: z80Carry=z80Reg[_reg_a]&1; z80Reg[_reg_a]>>=1; z80Flags(z80Reg[_reg_a]); break;
+    case _add_b: value=z80Reg[_reg_a]+z80Reg[_reg_b]; z80Carry=value>>8; z80Reg[_reg_a]=value; z80Flags(value); break;
+    case _and_fc: case _and_f8: case _and_f0: case _and_e0: case _and_c0: case _and_80:
+    case _and_01: case _and_03: case _and_07: case _and_0f:
+      switch(resultLines[i]){
+        case _and_fc: value=0xFC; break;
+        case _and_f8: value=0xF8; break;
+        case _and_f0: value=0xF0; break;
+        case _and_e0: value=0xE0; break;
+        case _and_c0: value=0xC0; break;
+        case _and_80: value=0x80; break;
+        case _and_01: value=0x01; break;
+        case _and_03: value=0x03; break;
+        case _and_07: value=0x07; break;
+        default: value=0x0F;
+      }
+      z80Reg[_reg_a]&=value; z80Carry=0; z80Flags(z80Reg[_reg_a]); break;
+    case _xor_a: z80Reg[_reg_a]=0; z80Carry=0; z80Flags(0); break;
+    case _ld_r_r: z80Set(resultOp1[i],z80Get(resultOp2[i])); break;
+    case _ld_r_n: z80Set(resultOp1[i],resultOp2[i]); break;
+    case _srl_r: value=z80Get(resultOp1[i]); z80Carry=value&1; value>>=1; z80Set(resultOp1[i],value); z80Flags(value); break;
+    case _rr_r: value=z80Get(resultOp1[i])|(z80Carry<<8); z80Carry=value&1; value>>=1; z80Set(resultOp1[i],value); z80Flags(value); break;
+    case _rl_r: value=(z80Get(resultOp1[i])<<1)|z80Carry; z80Carry=(value>>8)&1; z80Set(resultOp1[i],value); z80Flags(value&255); break;
+    case _rrc_r: value=z80Get(resultOp1[i]); z80Carry=value&1; value=(value>>1)|(z80Carry<<7); z80Set(resultOp1[i],value); z80Flags(value); break;
+    case _bit_r: z80Zero=((z80Get(resultOp1[i])>>resultOp2[i])&1)==0; break;
+    case _add_r: value=z80Reg[_reg_a]+z80Get(resultOp1[i]); z80Carry=value>>8; z80Reg[_reg_a]=value; z80Flags(value); break;
+    case _adc_r: value=z80Reg[_reg_a]+z80Get(resultOp1[i])+z80Carry; z80Carry=value>>8; z80Reg[_reg_a]=value; z80Flags(value); break;
+    case _sub_r: value=z80Reg[_reg_a]-z80Get(resultOp1[i]); z80Carry=value<0; z80Reg[_reg_a]=value; z80Flags(value); break;
+    case _sbc_r: value=z80Reg[_reg_a]-z80Get(resultOp1[i])-z80Carry; z80Carry=value<0; z80Reg[_reg_a]=value; z80Flags(value); break;
+    case _inc_r: value=z80Get(resultOp1[i])+1; z80Set(resultOp1[i],value); z80Flags(value); break;
+    case _dec_r: value=z80Get(resultOp1[i])-1; z80Set(resultOp1[i],value); z80Flags(value); break;
+    case _or_r: z80Reg[_reg_a]|=z80Get(resultOp1[i]); z80Carry=0; z80Flags(z80Reg[_reg_a]); break;
+    case _cp_r: value=z80Reg[_reg_a]-z80Get(resultOp1[i]); z80Carry=value<0; z80Flags(value); break;
+    case _cpl: z80Reg[_reg_a]^=255; break;
+    case _add_n: value=z80Reg[_reg_a]+resultOp1[i]; z80Carry=value>>8; z80Reg[_reg_a]=value; z80Flags(value); break;
+    case _and_n: z80Reg[_reg_a]&=resultOp1[i]; z80Carry=0; z80Flags(z80Reg[_reg_a]); break;
+    case _cp_n: value=z80Reg[_reg_a]-resultOp1[i]; z80Carry=value<0; z80Flags(value); break;
+    case _adc_n: value=z80Reg[_reg_a]+resultOp1[i]+z80Carry; z80Carry=value>>8; z80Reg[_reg_a]=value; z80Flags(value); break;
+    case _add_hl_rr:
+      value=z80Reg[_reg_h]*256+z80Reg[_reg_l]+z80Reg[resultOp1[i]*2]*256+z80Reg[resultOp1[i]*2+1];
+      z80Carry=value>>16; z80Reg[_reg_h]=value>>8; z80Reg[_reg_l]=value; break;
+    case _sbc_hl_rr:
+      value=z80Reg[_reg_h]*256+z80Reg[_reg_l]-(z80Reg[resultOp1[i]*2]*256+z80Reg[resultOp1[i]*2+1])-z80Carry;
+      z80Carry=value<0; z80Reg[_reg_h]=value>>8; z80Reg[_reg_l]=value;
+      z80Zero=((value&0xFFFF)==0); z80Sign=((value&0x8000)!=0); break;
+    case _ld_rr_nn: z80Reg[resultOp1[i]*2]=resultOp2[i]>>8; z80Reg[resultOp1[i]*2+1]=resultOp2[i]; break;
+    case _inc_rr:
+      value=z80Reg[resultOp1[i]*2]*256+z80Reg[resultOp1[i]*2+1]+1;
+      z80Reg[resultOp1[i]*2]=value>>8; z80Reg[resultOp1[i]*2+1]=value; break;
+    case _dec_rr:
+      value=z80Reg[resultOp1[i]*2]*256+z80Reg[resultOp1[i]*2+1]-1;
+      z80Reg[resultOp1[i]*2]=value>>8; z80Reg[resultOp1[i]*2+1]=value; break;
+    case _ld_a_ind: z80Reg[_reg_a]=z80Memory[z80Reg[resultOp1[i]*2]*256+z80Reg[resultOp1[i]*2+1]]; break;
+    case _ld_ind_a: z80Memory[z80Reg[resultOp1[i]*2]*256+z80Reg[resultOp1[i]*2+1]]=z80Reg[_reg_a]; break;
+    case _push_rr:
+      z80SP=(z80SP-2)&0xFFFF;
+      z80Memory[z80SP]=z80Reg[resultOp1[i]*2+1]; z80Memory[(z80SP+1)&0xFFFF]=z80Reg[resultOp1[i]*2]; break;
+    case _pop_rr:
+      z80Reg[resultOp1[i]*2+1]=z80Memory[z80SP]; z80Reg[resultOp1[i]*2]=z80Memory[(z80SP+1)&0xFFFF];
+      z80SP=(z80SP+2)&0xFFFF; break;
+    case _neg: value=-z80Reg[_reg_a]; z80Carry=(z80Reg[_reg_a]!=0); z80Reg[_reg_a]=value; z80Flags(value); break;
+    case _ex_de_hl:
+      value=z80Reg[_reg_d]; z80Reg[_reg_d]=z80Reg[_reg_h]; z80Reg[_reg_h]=value;
+      value=z80Reg[_reg_e]; z80Reg[_reg_e]=z80Reg[_reg_l]; z80Reg[_reg_l]=value; break;
+    case _jr_nc: if (!z80Carry) { (*time)++; i=findLabel(resultOp1[i]); } break;
+    case _jr_c:  if (z80Carry) { (*time)++; i=findLabel(resultOp1[i]); } break;
+    case _jr_z:  if (z80Zero) { (*time)++; i=findLabel(resultOp1[i]); } break;
+    case _jr: case _jp: i=findLabel(resultOp1[i]); break;
+    case _jp_hl: i=findAddress(z80Reg[_reg_h]*256+z80Reg[_reg_l])-1; break;
+    case _ld_rr_label:
+      value=lineAddress(findLabel(resultOp2[i]));
+      z80Reg[resultOp1[i]*2]=value>>8; z80Reg[resultOp1[i]*2+1]=value; break;
+    default: printf(";;---ERROR runCode---\n"); return -1;
+  }
+  return i+1;
+}
+
+// Runs the generated code on the current Z80 state until 'ret'.
+// Returns the microseconds used.
+int runCode(void) {
+  int time=0;
+  int steps=0;
+  int i=0;
+  while ((i<numResultLines)&&(steps<100000)) {
+    time+=lineTime(i);
+    steps++;
+    i=runLine(i,&time);
+    if (i<0) return time;
+  }
+  printf(";;---ERROR runCode: no ret---\n");
+  return time;
+}
+
+// Returns 1 if a line only uses A, B and carry, so it can be run on prefix states
+int isPrefixLine(int i) {
+  int ab1=(resultOp1[i]==_reg_a)||(resultOp1[i]==_reg_b);
+  int ab2=(resultOp2[i]==_reg_a)||(resultOp2[i]==_reg_b);
+  switch(resultLines[i]) {
+    case _ld_ba: case _rra: case _srl_a: case _add_b: case _rlca: case _rrca: case _rla: case _xor_a:
+    case _and_fc: case _and_f8: case _and_f0: case _and_e0: case _and_c0: case _and_80:
+    case _and_01: case _and_03: case _and_07: case _and_0f:
+    case _add_n: case _and_n: case _adc_n: case _cpl: case _neg:
+      return 1;
+    case _srl_r: case _rr_r: case _rl_r: case _rrc_r: case _add_r: case _adc_r: case _sub_r: case _sbc_r:
+    case _inc_r: case _dec_r: case _or_r: case _ld_r_n:
+      return ab1;
+    case _ld_r_r:
+      return ab1&&ab2;
+  }
+  return 0;
+}
+
+// Returns the state with the given registers, adding it if it is new.
+// Returns -1 if there is no room left.
+int findPrefixState(unsigned char *a,unsigned char *b,unsigned char *carry) {
+  unsigned int hash=2166136261u;  // FNV-1a of the registers
+  int s;
+  for (int j=0;j<256;j++) hash=((hash^a[j])*16777619u^b[j])*16777619u;
+  for (int j=0;j<32;j++) hash=(hash^carry[j])*16777619u;
+  hash%=MAXSTATES;
+  for (s=stateHash[hash];s>=0;s=stateSame[s]) {
+    if ((memcmp(stateA[s],a,256)==0)&&(memcmp(stateB[s],b,256)==0)&&(memcmp(stateCarry[s],carry,32)==0)) {
+      if (statsEnabled) statCacheHits++;
+      return s;
+    }
+  }
+  if (numStates==MAXSTATES) return -1;
+  s=numStates++;
+  memcpy(stateA[s],a,256);
+  memcpy(stateB[s],b,256);
+  memcpy(stateCarry[s],carry,32);
+  stateSame[s]=stateHash[hash];
+  stateHash[hash]=s;
+  return s;
+}
+
+// Runs the code (without jumps, until 'ret') on all the inputs, with B and
+// carry starting at 0, through the prefix states. Only the lines after the
+// longest beginning already run are run again. Returns the final state, or
+// -1 if the code has lines using other registers.
+int runPrefixStates(void) {
+  unsigned char a[256];
+  unsigned char b[256];
+  unsigned char carry[32];
+  unsigned int hash;
+  int state=0;
+  int next;
+  int time;
+  for (int i=0;(i<numResultLines)&&(resultLines[i]!=_ret);i++) {
+    if (!isPrefixLine(i)) return -1;
+  }
+  if (numStates==0) { // start again with the input
+    for (int i=0;i<MAXSTATES;i++) stateHash[i]=stepHash[i]=-1;
+    numSteps=0;
+    for (int j=0;j<256;j++) a[j]=j;
+    memset(b,0,256);
+    memset(carry,0,32);
+    findPrefixState(a,b,carry);
+  }
+  for (int i=0;(i<numResultLines)&&(resultLines[i]!=_ret);i++) {
+    hash=((unsigned int)state*7919u+resultLines[i]*131u+resultOp1[i]*17u+resultOp2[i])%MAXSTATES;
+    for (next=stepHash[hash];next>=0;next=stepSame[next]) {
+      if ((stepFrom[next]==state)&&(stepLine[next]==resultLines[i])&&(stepOp1[next]==resultOp1[i])&&(stepOp2[next]==resultOp2[i])) break;
+    }
+    if (next>=0) { // already run
+      if (statsEnabled) statCacheHits++;
+      state=stepTo[next];
+      continue;
+    }
+    memset(carry,0,32);
+    for (int j=0;j<256;j++) { // run the line for all inputs
+      z80Reg[_reg_a]=stateA[state][j];
+      z80Reg[_reg_b]=stateB[state][j];
+      z80Carry=(stateCarry[state][j>>3]>>(j&7))&1;
+      runLine(i,&time);
+      a[j]=z80Reg[_reg_a];
+      b[j]=z80Reg[_reg_b];
+      carry[j>>3]|=z80Carry<<(j&7);
+    }
+    next=findPrefixState(a,b,carry);
+    if ((next<0)||(numSteps==MAXSTATES)) { // full: forget all states
+      numStates=0;
+      return runPrefixStates();
+    }
+    stepFrom[numSteps]=state;
+    stepLine[numSteps]=resultLines[i];
+    stepOp1[numSteps]=resultOp1[i];
+    stepOp2[numSteps]=resultOp2[i];
+    stepTo[numSteps]=next;
+    stepSame[numSteps]=stepHash[hash];
+    stepHash[hash]=numSteps;
+    numSteps++;
+    state=next;
+  }
+  return state;
+}
+
+// Returns the expected result of a division by num (div==0) or of a
+// multiplication by the fraction num/div
+int expectedResult(float num,int div,int j) {
+  int result;
+  if (div==0) return exactQuotient(num,j);
+  if (fractionRound) result=(j*(int)num+div/2)/div;
+  else result=(j*(int)num)/div;
+  if ((num>div)&&(fractionResult==_result_saturate)&&(result>255)) return 255;
+  if ((num>div)&&(fractionResult==_result_wrap)) return result&255;
+  return result;
+}
+
+// Tests the generated code for all 256 inputs, collecting timing statistics.
+// Returns the first input that fails, or -1 if all results are correct.
+int testCode(float num,int div) {
+  int base;
+  int result;
+  int time;
+  unsigned char kept[8];
+  for (int j=0;j<256;j++) {
+    base=0x8000+((j*37)&0x7FF);
+    if (indexMode==_index_page) base&=0xFF00;
+    z80Reg[_reg_a]=j;
+    z80Reg[_reg_h]=base>>8;
+    z80Reg[_reg_l]=base;
+    z80Reg[_reg_d]=base>>8;
+    z80Reg[_reg_e]=base;
+    z80IX=base;
+    for (int r=_reg_b;r<=_reg_l;r++) {
+      if ((preserveMask>>r)&1) z80Reg[r]=j*29+r*53;
+    }
+    if (operandIn!=_reg_a) {
+      z80Reg[_reg_a]=j^0x5A;  // the input is somewhere else
+      z80Set(operandIn,j);
+    }
+    for (int r=0;r<8;r++) kept[r]=z80Reg[r];
+    time=runCode();
+    addTime(time);
+    if (timeWeights!=NULL) {
+      timeWeighted+=(double)time*timeWeights[j];
+      timeWeightSum+=timeWeights[j];
+    }
+    for (int r=_reg_b;r<=_reg_l;r++) {
+      if (((preserveMask>>r)&1)&&(z80Reg[r]!=kept[r])) return j;
+    }
+    if ((div!=0)&&(num>div)&&(fractionResult==_result_hl)) result=z80Reg[_reg_h]*256+z80Reg[_reg_l];
+    else if (indexMode==_index_none) result=z80Get(operandOut);
+    else if (indexMode==_index_de) result=z80Reg[_reg_d]*256+z80Reg[_reg_e]-base;
+    else result=z80Reg[_reg_h]*256+z80Reg[_reg_l]-base;
+    if (result!=expectedResult(num,div,j)*indexScale) return j;
+    if ((flagContract&_flag_z)&&(z80Zero!=(result==0))) return j;
+    if ((flagContract&_flag_s)&&(z80Sign!=((result&128)!=0))) return j;
+    if ((flagContract&_flag_nc)&&z80Carry) return j;
+  }
+  return -1;
+}
+
+// Generates the indexing code at every 'ret' of the saved code. 'fused' is the
+// number of final 'srl a' merged with the multiplication by indexScale.
+// Returns 0 if the code doesn't end with enough 'srl a' to merge.
+int buildIndexing(int maxResult,int fused) {
+  int shifts=0;
+  int shifts8=0;
+  int end;
+  while ((1<<shifts)<indexScale) shifts++;
+  while ((shifts8<shifts)&&((maxResult<<(shifts8+1))<=255)) shifts8++;
+  if (fused>shifts8) return 0;
+  numResultLines=0;
+  for (int i=0;i<numSavedLines;i++) {
+    if (savedLines[i]!=_ret) {
+      addLineOp(savedLines[i],savedOp1[i],savedOp2[i]);
+      continue;
+    }
+    end=numResultLines;
+    if ((end>0)&&(resultLines[end-1]==_ld_r_n)&&(resultOp1[end-1]==_reg_a)&&((resultOp2[end-1]<<shifts8)<=255)) {
+      resultOp2[end-1]<<=shifts8;  // constant result, multiply it directly
+      if (fused>0) return 0;
+    }
+    else {
+      for (int j=0;j<fused;j++) {
+        if ((numResultLines==0)||(resultLines[numResultLines-1]!=_srl_a)) return 0;
+        numResultLines--;  // remove last 'srl a' and clear the bits it would have discarded
+      }
+      if (fused>0) addLineOp(_and_n,(0xFF<<fused)&0xFF,0);
+      for (int j=fused;j<shifts8;j++) addLineOp(_add_r,_reg_a,0);
+    }
+    if (shifts8==shifts) { // scaled result fits in 8 bits
+      if (indexMode==_index_page) {
+        addLineOp(_ld_r_r,_reg_l,_reg_a);
+      }
+      else if (indexMode==_index_hl) {
+        addLineOp(_add_r,_reg_l,0);
+        addLineOp(_ld_r_r,_reg_l,_reg_a);
+        addLineOp(_adc_r,_reg_h,0);
+        addLineOp(_sub_r,_reg_l,0);
+        addLineOp(_ld_r_r,_reg_h,_reg_a);
+      }
+      else {
+        addLineOp(_add_r,_reg_e,0);
+        addLineOp(_ld_r_r,_reg_e,_reg_a);
+        addLineOp(_adc_r,_reg_d,0);
+        addLineOp(_sub_r,_reg_e,0);
+        addLineOp(_ld_r_r,_reg_d,_reg_a);
+      }
+    }
+    else if (indexMode==_index_hl) {
+      addLineOp(_ld_r_r,_reg_e,_reg_a);
+      addLineOp(_ld_r_n,_reg_d,0);
+      addLine(_ex_de_hl);
+      for (int j=shifts8;j<shifts;j++) addLineOp(_add_hl_rr,_pair_hl,0);
+      addLineOp(_add_hl_rr,_pair_de,0);
+    }
+    else {
+      addLineOp(_ld_r_r,_reg_l,_reg_a);
+      addLineOp(_ld_r_n,_reg_h,0);
+      for (int j=shifts8;j<shifts;j++) addLineOp(_add_hl_rr,_pair_hl,0);
+      addLineOp(_add_hl_rr,_pair_de,0);
+      addLine(_ex_de_hl);
+    }
+    addLine(_ret);
+  }
+  indexWide=(shifts8!=shifts);
+  return 1;
+}
+
+// Adds the result in A, multiplied by indexScale, to the base address in HL or
+// DE (or moves it to L for an aligned table), choosing the cheapest number of
+// final shifts to merge with the multiplication. Optimizes the code.
+void addIndexing(int maxResult) {
+  int best=-1;
+  int bestSpeed=0;
+  int bestSize=0;
+  numSavedLines=numResultLines;
+  for (int i=0;i<numResultLines;i++) {
+    savedLines[i]=resultLines[i];
+    savedOp1[i]=resultOp1[i];
+    savedOp2[i]=resultOp2[i];
+  }
+  for (int fused=0;(1<<fused)<=indexScale;fused++) {
+    if (!buildIndexing(maxResult,fused)) continue;
+    optimizeCode();
+    measureCode();
+    if ((best<0)||(speedResult<bestSpeed)||((speedResult==bestSpeed)&&(sizeResult<bestSize))) {
+      best=fused;
+      bestSpeed=speedResult;
+      bestSize=sizeResult;
+    }
+  }
+  buildIndexing(maxResult,best);
+  optimizeCode();
+}
+
+// Finishes the generated code: adds indexing, optimizes, measures and tests it
+// Makes the code read its input from operandIn and leave its result in
+// operandOut. The input may replace B as the value added by the chain, and
+// results which are just a shift of the input may be shifted in place.
+// The cheapest version is kept.
+void applyOperands(float num,int div) {
+  int lines[MAXLINES];
+  int op1[MAXLINES];
+  int op2[MAXLINES];
+  int bestLines[MAXLINES];
+  int bestOp1[MAXLINES];
+  int bestOp2[MAXLINES];
+  int numLines=numResultLines;
+  int numBest=0;
+  int bestSpeed=-1;
+  int bestSize=0;
+  int canFold;
+  int shift=-1;
+  for (int i=0;i<numLines;i++) {
+    lines[i]=resultLines[i];
+    op1[i]=resultOp1[i];
+    op2[i]=resultOp2[i];
+  }
+  canFold=(operandIn!=_reg_a)&&(numLines>0)&&(lines[0]==_ld_ba);
+  for (int i=1;i<numLines;i++) { // B must only be used by the chain
+    if (lines[i]==_ld_ba) canFold=0;
+    if ((lines[i]>=_ld_r_r)&&(lines[i]<=_cp_r)&&(op1[i]==_reg_b)) canFold=0;
+    if ((lines[i]==_ld_r_r)&&(op2[i]==_reg_b)) canFold=0;
+  }
+  for (int k=0;(k<=8)&&(shift<0);k++) {
+    shift=k;
+    for (int j=0;j<256;j++) {
+      if (expectedResult(num,div,j)!=(j>>k)) shift=-1;
+    }
+  }
+  if ((shift>=0)&&(operandOut!=operandIn)&&((operandOut==_reg_hl_ind)||(operandOut==_reg_ix_ind))) shift=-1;
+  for (int version=0;version<3;version++) {
+    numResultLines=0;
+    if (version<2) {
+      if ((version==1)&&!canFold) continue;
+      if (operandIn!=_reg_a) addLineOp(_ld_r_r,_reg_a,operandIn);
+      for (int i=0;i<numLines;i++) {
+        if ((version==1)&&(i==0)) continue;  // no 'ld b,a'
+        if ((version==1)&&(lines[i]==_add_b)) addLineOp(_add_r,operandIn,0);
+        else if (lines[i]==_ret) {
+          if (operandOut!=_reg_a) addLineOp(_ld_r_r,operandOut,_reg_a);
+          addLine(_ret);
+        }
+        else addLineOp(lines[i],op1[i],op2[i]);
+      }
+    }
+    else {
+      if (shift<0) continue;
+      if (shift==8) addLineOp(_ld_r_n,operandOut,0);
+      else {
+        if (operandOut!=operandIn) addLineOp(_ld_r_r,operandOut,operandIn);
+        for (int k=0;k<shift;k++) addLineOp(_srl_r,operandOut,0);
+      }
+      addLine(_ret);
+    }
+    measureCode();
+    if ((bestSpeed<0)||(speedResult<bestSpeed)||((speedResult==bestSpeed)&&(sizeResult<bestSize))) {
+      bestSpeed=speedResult;
+      bestSize=sizeResult;
+      numBest=numResultLines;
+      for (int i=0;i<numResultLines;i++) {
+        bestLines[i]=resultLines[i];
+        bestOp1[i]=resultOp1[i];
+        bestOp2[i]=resultOp2[i];
+      }
+    }
+  }
+  numResultLines=0;
+  for (int i=0;i<numBest;i++) addLineOp(bestLines[i],bestOp1[i],bestOp2[i]);
+}
+
+// Returns 1 if the code reads or writes reg
+int usesRegister(int reg) {
+  int line;
+  if ((reg==operandIn)||(reg==operandOut)) return 1;
+  if (((reg==_reg_h)||(reg==_reg_l))&&((operandIn==_reg_hl_ind)||(operandOut==_reg_hl_ind))) return 1;
+  if (((reg==_reg_ixh)||(reg==_reg_ixl))&&((operandIn==_reg_ix_ind)||(operandOut==_reg_ix_ind))) return 1;
+  for (int i=0;i<numResultLines;i++) {
+    line=resultLines[i];
+    if (((line==_ld_ba)||(line==_add_b))&&(reg==_reg_b)) return 1;
+    if ((line>=_ld_r_r)&&(line<=_cp_r)) {
+      if ((resultOp1[i]==reg)||((line==_ld_r_r)&&(resultOp2[i]==reg))) return 1;
+    }
+    if ((line>=_ld_rr_nn)&&(line<=_ld_ind_a)&&(line!=_ex_de_hl)&&(line!=_neg)) {
+      if ((reg==resultOp1[i]*2)||(reg==resultOp1[i]*2+1)) return 1;
+    }
+    if (((line==_add_hl_rr)||(line==_sbc_hl_rr))&&((reg==_reg_h)||(reg==_reg_l))) return 1;
+    if ((line==_ex_de_hl)&&(reg>=_reg_d)&&(reg<=_reg_l)) return 1;
+  }
+  return 0;
+}
+
+// Changes the register used by the code for keeping the input from B to reg.
+// Returns 0 if an instruction has no form using reg.
+int moveRegisterB(int reg) {
+  int other;
+  for (int i=0;i<numResultLines;i++) {
+    if (resultLines[i]==_ld_ba) {
+      resultLines[i]=_ld_r_r; resultOp1[i]=reg; resultOp2[i]=_reg_a;
+    }
+    else if (resultLines[i]==_add_b) {
+      resultLines[i]=_add_r; resultOp1[i]=reg; resultOp2[i]=0;
+    }
+    else if ((resultLines[i]>=_ld_r_r)&&(resultLines[i]<=_cp_r)) {
+      if ((resultOp1[i]!=_reg_b)&&!((resultLines[i]==_ld_r_r)&&(resultOp2[i]==_reg_b))) continue;
+      if (isHalfRegister(reg)) { // no shifts, and no H, L or memory with the prefix
+        if ((resultLines[i]>=_srl_r)&&(resultLines[i]<=_bit_r)) return 0;
+        other=(resultOp1[i]==_reg_b)?resultOp2[i]:resultOp1[i];
+        if ((resultLines[i]==_ld_r_r)&&((other==_reg_h)||(other==_reg_l)||(other==_reg_hl_ind)||(other==_reg_ix_ind)||isHalfRegister(other))) return 0;
+      }
+      if (resultOp1[i]==_reg_b) resultOp1[i]=reg;
+      if ((resultLines[i]==_ld_r_r)&&(resultOp2[i]==_reg_b)) resultOp2[i]=reg;
+    }
+  }
+  return 1;
+}
+
+// Keeps the registers in preserveMask unchanged. The input copy the code
+// keeps in B may be moved to an unused register (also IXL, IXH, IYL and IYH
+// with --undocumented), and the pairs of other changed registers are saved
+// in the stack. The cheapest version is kept.
+void applyPreserve(void) {
+  int candidates[]={-1,_reg_c,_reg_d,_reg_e,_reg_h,_reg_l,_reg_ixl,_reg_ixh,_reg_iyl,_reg_iyh};
+  int lines[MAXLINES];
+  int op1[MAXLINES];
+  int op2[MAXLINES];
+  int bestLines[MAXLINES];
+  int bestOp1[MAXLINES];
+  int bestOp2[MAXLINES];
+  int written[NUMREGISTERS];
+  int numLines=numResultLines;
+  int numBest=0;
+  int bestSpeed=-1;
+  int bestSize=0;
+  int pairs;
+  int usesB=usesRegister(_reg_b);
+  int valid;
+  for (int i=0;i<numLines;i++) {
+    lines[i]=resultLines[i];
+    op1[i]=resultOp1[i];
+    op2[i]=resultOp2[i];
+  }
+  for (int c=0;c<10;c++) {
+    numResultLines=0;
+    for (int i=0;i<numLines;i++) addLineOp(lines[i],op1[i],op2[i]);
+    if (candidates[c]>=0) {
+      if (!usesB||!((preserveMask>>_reg_b)&1)) break;
+      if (isHalfRegister(candidates[c])&&!undocumented) break;
+      if (((preserveMask>>candidates[c])&1)||usesRegister(candidates[c])) continue;
+      if (!moveRegisterB(candidates[c])) continue;
+    }
+    findWritten(written);
+    pairs=0;
+    valid=1;
+    for (int p=_pair_bc;p<=_pair_hl;p++) {
+      if (!((written[p*2]&&((preserveMask>>(p*2))&1))||(written[p*2+1]&&((preserveMask>>(p*2+1))&1)))) continue;
+      if ((operandOut==p*2)||(operandOut==p*2+1)) valid=0;  // restoring it would lose the result
+      pairs|=1<<p;
+    }
+    if (!valid) continue;
+    numResultLinesTemp=0;
+    for (int i=0;i<numResultLines;i++) {
+      resultLinesTemp[numResultLinesTemp]=resultLines[i];
+      resultOp1Temp[numResultLinesTemp]=resultOp1[i];
+      resultOp2Temp[numResultLinesTemp]=resultOp2[i];
+      numResultLinesTemp++;
+    }
+    numResultLines=0;
+    for (int p=_pair_bc;p<=_pair_hl;p++) if ((pairs>>p)&1) addLineOp(_push_rr,p,0);
+    for (int i=0;i<numResultLinesTemp;i++) {
+      if (resultLinesTemp[i]==_ret) {
+        for (int p=_pair_hl;p>=_pair_bc;p--) if ((pairs>>p)&1) addLineOp(_pop_rr,p,0);
+      }
+      addLineOp(resultLinesTemp[i],resultOp1Temp[i],resultOp2Temp[i]);
+    }
+    measureCode();
+    if ((bestSpeed<0)||(speedResult<bestSpeed)||((speedResult==bestSpeed)&&(sizeResult<bestSize))) {
+      bestSpeed=speedResult;
+      bestSize=sizeResult;
+      numBest=numResultLines;
+      for (int i=0;i<numResultLines;i++) {
+        bestLines[i]=resultLines[i];
+        bestOp1[i]=resultOp1[i];
+        bestOp2[i]=resultOp2[i];
+      }
+    }
+  }
+  numResultLines=0;
+  if (bestSpeed<0) {
+    printf(";;---ERROR registers can't be preserved---\n");
+    for (int i=0;i<numLines;i++) addLineOp(lines[i],op1[i],op2[i]);
+    return;
+  }
+  for (int i=0;i<numBest;i++) addLineOp(bestLines[i],bestOp1[i],bestOp2[i]);
+}
+
+// Makes the flags on return keep flagContract, proving it in the emulator.
+// The code is kept if they already do. If not, 'or a' is added before each
+// 'ret' (and before the pops and the copy of the result to the output), or
+// 'inc out / dec out' if the result is not in A.
+void applyFlags(float num,int div) {
+  int lines[MAXLINES];
+  int op1[MAXLINES];
+  int op2[MAXLINES];
+  int numLines=numResultLines;
+  int tail;
+  if (testCode(num,div)<0) return;  // already for free
+  for (int i=0;i<numLines;i++) {
+    lines[i]=resultLines[i];
+    op1[i]=resultOp1[i];
+    op2[i]=resultOp2[i];
+  }
+  for (int version=0;version<2;version++) {
+    numResultLines=0;
+    for (int i=0;i<numLines;i++) {
+      if (version==0) {
+        tail=i;  // lines before the next 'ret' which don't change the flags
+        while ((tail<numLines)&&((lines[tail]==_pop_rr)||((lines[tail]==_ld_r_r)&&(op2[tail]==_reg_a)))) tail++;
+        if ((tail<numLines)&&(lines[tail]==_ret)&&((i==0)||!((lines[i-1]==_pop_rr)||((lines[i-1]==_ld_r_r)&&(op2[i-1]==_reg_a))))) {
+          addLineOp(_or_r,_reg_a,0);
+        }
+      }
+      else if (lines[i]==_ret) {
+        if (flagContract&_flag_nc) addLineOp(_or_r,_reg_a,0);
+        if (flagContract&(_flag_z|_flag_s)) {
+          addLineOp(_inc_r,operandOut,0);
+          addLineOp(_dec_r,operandOut,0);
+        }
+      }
+      addLineOp(lines[i],op1[i],op2[i]);
+    }
+    if (testCode(num,div)<0) return;
+  }
+  printf(";;---ERROR flags can't be guaranteed---\n");
+}
+
+void finishCode(float num,int div) {
+  int failed;
+  if (indexMode!=_index_none) addIndexing(expectedResult(num,div,255));
+  else optimizeCode();
+  if ((operandIn!=_reg_a)||(operandOut!=_reg_a)) applyOperands(num,div);
+  if (preserveMask!=0) applyPreserve();
+  if (flagContract!=0) applyFlags(num,div);
+  measureCode();
+  resetTimes();
+  phaseBegin(_phase_test);
+  failed=testCode(num,div);
+  phaseEnd(_phase_test);
+  if (failed>=0) printf(";;---ERROR test fails for input %d---\n",failed);
+}
+
+// Add the code for a multiplication by the fraction i/2^divpow, without 'ret'.
+// Returns the number of powers of two used (B register is used if more than 1)
+int buildChain(int i,int divpow) {
   int difference;
   int arrrayPowersOf2[MAXPOWER2+1];
   int numpowers=0;
@@ -371,44 +1843,457 @@ void generateCode(float num,int i,int div,int divpow) {
       difference--;
     }
   }
-  addLine(_ret);
-  optimizeCode();
-  measureCode();
-  if (numpowers>1) {
-    printHeader(num,sizeResult,speedResult,_destroys_b,div);
+  return numpowers;
+}
+
+// Add the code for shifting HL right. If carry is set, the carry of the
+// previous addition enters as bit 16.
+void addShift16(int shift,int carry) {
+  if ((shift>0)&&carry) {
+    addLineOp(_rr_r,_reg_h,0);
+    addLineOp(_rr_r,_reg_l,0);
+    shift--;
   }
-  else {
-    printHeader(num,sizeResult,speedResult,_only_use_a,div);
+  while (shift>=8) { // move a whole byte
+    addLineOp(_ld_r_r,_reg_l,_reg_h);
+    addLineOp(_ld_r_n,_reg_h,0);
+    shift-=8;
+  }
+  while (shift>0) {
+    addLineOp(_srl_r,_reg_h,0);
+    addLineOp(_rr_r,_reg_l,0);
+    shift--;
   }
-  printlines();
 }
 
-
-// Find a fraction multiplication equivalent to the desired division
-void findApproximation(float i) {
+// Add the code for HL = (bias*2^e + DE*m) / 2^s, where 2^e is the lowest power
+// of two of m. Like buildChain, DE is added for each power of two of m, from
+// the lowest one, shifting HL right between them. No precision is lost.
+void buildChain16(long long m,int s,int bias) {
+  int powers[64];
+  int numPowers=0;
+  for (int bit=0;bit<63;bit++) {
+    if ((m>>bit)&1) powers[numPowers++]=bit;
+  }
+  for (int j=0;j<numPowers;j++) {
+    if ((j==0)&&(bias==0)) {
+      addLineOp(_ld_r_r,_reg_h,_reg_d);
+      addLineOp(_ld_r_r,_reg_l,_reg_e);
+    }
+    else {
+      if (j==0) addLineOp(_ld_rr_nn,_pair_hl,bias);
+      addLineOp(_add_hl_rr,_pair_de,0);
+    }
+    if (j<numPowers-1) addShift16(powers[j+1]-powers[j],(j>0)||(bias!=0));
+    else addShift16(s-powers[j],(j>0)||(bias!=0));
+  }
+}
+
+// Fill repPos[] and repNeg[] with the signed digit representations of v
+// (mod 2^bits). Each odd value gives two ways: digit +1 or digit -1.
+void findReps(long long v,int bit,int bits,int pos,int neg) {
+  if ((v==0)||(bit==bits)) {
+    if (((pos|neg)!=0)&&(numReps<MAXREPS)) {
+      repPos[numReps]=pos;
+      repNeg[numReps]=neg;
+      numReps++;
+    }
+    return;
+  }
+  if ((v&1)==0) findReps(v/2,bit+1,bits,pos,neg);
+  else {
+    findReps((v-1)/2,bit+1,bits,pos|(1<<bit),neg);
+    findReps((v+1)/2,bit+1,bits,pos,neg|(1<<bit));
+  }
+}
+
+// Returns the highest digit of a representation
+int topDigit(int digits) {
+  int top=0;
+  while ((digits>>(top+1))!=0) top++;
+  return top;
+}
+
+// Returns the number of non zero digits of a representation
+int countDigits(int digits) {
+  int count=0;
+  for (;digits!=0;digits&=digits-1) count++;
+  return count;
+}
+
+// Add the code for A = A * (pos - neg) (mod 256), doubling A and adding or
+// subtracting the input (kept in reg, copied there if load is set) from the
+// highest digit
+void addMultiplyDigits8(int pos,int neg,int reg,int load) {
+  int top=topDigit(pos|neg);
+  if ((countDigits(pos|neg)>1)&&load) {  // input is needed later
+    if (reg==_reg_b) addLine(_ld_ba);
+    else addLineOp(_ld_r_r,reg,_reg_a);
+  }
+  if ((neg>>top)&1) addLine(_neg);
+  for (int bit=top-1;bit>=0;bit--) {
+    addLineOp(_add_r,_reg_a,0);
+    if ((pos>>bit)&1) {
+      if (reg==_reg_b) addLine(_add_b);
+      else addLineOp(_add_r,reg,0);
+    }
+    if ((neg>>bit)&1) addLineOp(_sub_r,reg,0);
+  }
+}
+
+// Find the cheapest representation of n (mod 256) for addMultiplyDigits8.
+// Candidates are measured at the end of the code and then removed.
+// Returns the time*1000+size of the best one.
+int bestMultiplyDigits8(int n,int reg,int load,int *bestPos,int *bestNeg) {
+  int start=numResultLines;
+  int best=-1;
+  int cost;
+  int size;
+  numReps=0;
+  findReps(n,0,8,0,0);
+  for (int i=0;i<numReps;i++) {
+    countCandidate(1);
+    numResultLines=start;
+    addMultiplyDigits8(repPos[i],repNeg[i],reg,load);
+    cost=measureFrom(start,&size)*1000+size;
+    if ((best<0)||(cost<best)) {
+      best=cost;
+      *bestPos=repPos[i];
+      *bestNeg=repNeg[i];
+    }
+  }
+  numResultLines=start;
+  return best;
+}
+
+// Add the code for A = A * n (mod 256), using reg for keeping the input
+// (copied there if load is set). The cheapest signed digit chain is used,
+// or two chained multiplications by factors of n if they are cheaper.
+void buildMultiplyReg(int n,int reg,int load) {
+  int pos;
+  int neg;
+  int pos2;
+  int neg2;
+  int best;
+  int cost;
+  int bestFactor=0;
+  n&=255;
+  if (n==0) {
+    addLine(_xor_a);
+    return;
+  }
+  best=bestMultiplyDigits8(n,reg,load,&pos,&neg);
+  for (int f=3;f*f<=n;f++) {
+    if ((n%f)!=0) continue;
+    cost=bestMultiplyDigits8(f,reg,load,&pos2,&neg2)+bestMultiplyDigits8(n/f,reg,1,&pos2,&neg2);
+    if (cost<best) {
+      best=cost;
+      bestFactor=f;
+    }
+  }
+  if (bestFactor==0) {
+    addMultiplyDigits8(pos,neg,reg,load);
+    return;
+  }
+  bestMultiplyDigits8(bestFactor,reg,load,&pos,&neg);
+  addMultiplyDigits8(pos,neg,reg,load);
+  bestMultiplyDigits8(n/bestFactor,reg,1,&pos,&neg);
+  addMultiplyDigits8(pos,neg,reg,1);
+}
+
+// Add the code for A = A * n (mod 256), using B register
+void buildMultiply8(int n) {
+  buildMultiplyReg(n,_reg_b,1);
+}
+
+// Add the code that leaves the result of a fraction above 1 in A (saturated
+// or wrapped, as fractionResult says) from its 16 bits value in HL, and 'ret'
+void addResultFromHL(void) {
+  int label;
+  if (fractionResult==_result_saturate) {
+    label=newLabel(NULL);
+    addLineOp(_ld_r_r,_reg_a,_reg_h);
+    addLineOp(_or_r,_reg_a,0);
+    addLineOp(_ld_r_r,_reg_a,_reg_l);
+    addLineOp(_jr_z,label,0);
+    addLineOp(_ld_r_n,_reg_a,255);
+    addLineOp(_label,label,0);
+  }
+  else if (fractionResult==_result_wrap) addLineOp(_ld_r_r,_reg_a,_reg_l);
+  addLine(_ret);
+}
+
+// Add the code for a multiplication by the fraction i/2^divpow above 1, with
+// i=n*2^divpow+r, using one of three methods. 0: HL = A*i, then shifted right.
+// 1: the chain of r/2^divpow, plus n times B (for n up to 4). 2: HL = the
+// chain of r/2^divpow over DE, plus n times DE (for n up to 4).
+// Returns 0 if the method can't be used.
+int buildFractionAbove1(int i,int divpow,int method) {
+  int n;
+  int r;
+  int top=0;
+  int label;
+  while (((i&1)==0)&&(divpow>0)) { // same fraction with a lower power of 2
+    i>>=1;
+    divpow--;
+  }
+  n=i>>divpow;
+  r=i&((1<<divpow)-1);
+  if (((r*255)>>divpow)==0) r=0;  // A*r/2^divpow is always 0
+  if ((method!=0)&&(n>4)) return 0;
+  if (method==1) {
+    if (r==0) {
+      n--;  // A already is the input
+      if (n>0) addLine(_ld_ba);
+    }
+    else {
+      buildChain(r,divpow);
+      if (resultLines[0]!=_ld_ba) { // the input is kept in B in any case
+        addLine(_ld_ba);  // room for it at the start
+        for (int l=numResultLines-1;l>0;l--) {
+          resultLines[l]=resultLines[l-1];
+          resultOp1[l]=resultOp1[l-1];
+          resultOp2[l]=resultOp2[l-1];
+        }
+        resultLines[0]=_ld_ba;
+      }
+    }
+    if (fractionResult==_result_hl) {
+      if (n==0) {
+        addLineOp(_ld_r_r,_reg_l,_reg_a);
+        addLineOp(_ld_r_n,_reg_h,0);
+      }
+      else if (n==1) {
+        addLine(_add_b);
+        addLineOp(_ld_r_r,_reg_l,_reg_a);
+        addLineOp(_ld_r_n,_reg_h,0);
+        addLineOp(_rl_r,_reg_h,0);  // carry is bit 8
+      }
+      else {
+        addLineOp(_ld_r_r,_reg_l,_reg_a);
+        addLineOp(_ld_r_n,_reg_h,0);
+        addLineOp(_ld_r_r,_reg_c,_reg_b);
+        addLineOp(_ld_r_r,_reg_b,_reg_h);
+        for (int k=0;k<n;k++) addLineOp(_add_hl_rr,_pair_bc,0);
+      }
+    }
+    else if ((fractionResult==_result_saturate)&&(n>0)) {
+      label=newLabel(NULL);
+      for (int k=0;k<n;k++) {
+        addLine(_add_b);
+        addLineOp(_jr_c,label,0);
+      }
+      addLine(_ret);
+      addLineOp(_label,label,0);
+      addLineOp(_ld_r_n,_reg_a,255);
+    }
+    else for (int k=0;k<n;k++) addLine(_add_b);
+    addLine(_ret);
+    return 1;
+  }
+  addLineOp(_ld_r_r,_reg_e,_reg_a);
+  addLineOp(_ld_r_n,_reg_d,0);
+  if (method==0) {
+    while ((i>>(top+1))!=0) top++;
+    addLineOp(_ld_r_r,_reg_h,_reg_d);
+    addLineOp(_ld_r_r,_reg_l,_reg_e);
+    for (int bit=top-1;bit>=0;bit--) { // from the highest bit of i
+      addLineOp(_add_hl_rr,_pair_hl,0);
+      if ((i>>bit)&1) addLineOp(_add_hl_rr,_pair_de,0);
+    }
+    addShift16(divpow,0);
+  }
+  else {
+    if (r==0) {
+      addLineOp(_ld_r_r,_reg_h,_reg_d);
+      addLineOp(_ld_r_r,_reg_l,_reg_e);
+      n--;
+    }
+    else buildChain16(r,divpow,0);
+    for (int k=0;k<n;k++) addLineOp(_add_hl_rr,_pair_de,0);
+  }
+  addResultFromHL();
+  return 1;
+}
+
+// Add the code of the fastest method for a fraction i/2^divpow above 1, 'ret'
+// included. Methods which don't pass the test are skipped.
+void buildBestFractionAbove1(float num,int i,int div,int divpow) {
+  int best=0;
+  int bestWorst=-1;
+  int bestSize=0;
+  for (int method=0;method<3;method++) {
+    resetCode();
+    if (!buildFractionAbove1(i,divpow,method)) continue;
+    optimizeCode();
+    measureCode();
+    resetTimes();
+    if (testCode(num,div)>=0) continue;
+    if ((bestWorst<0)||(timeWorst<bestWorst)||((timeWorst==bestWorst)&&(sizeResult<bestSize))) {
+      best=method;
+      bestWorst=timeWorst;
+      bestSize=sizeResult;
+    }
+  }
+  resetCode();
+  buildFractionAbove1(i,divpow,best);
+}
+
+// Create code for a multiplication by a fraction
+void generateCode(float num,int i,int div,int divpow) {
+  int numpowers=0;
+  phaseBegin(_phase_generate);
+  resetCode();
+  if ((div!=0)&&(i>div)) buildBestFractionAbove1(num,i,div,divpow);
+  else {
+    numpowers=buildChain(i,divpow);
+    addLine(_ret);
+  }
+  finishCode(num,div);
+  if ((div!=0)&&(i>div)) {
+    printHeader(num,sizeResult,timeWorst,_destroys_b,div);  // the code may branch
+  }
+  else if (numpowers>1) {
+    printHeader(num,sizeResult,speedResult,_destroys_b,div);
+  }
+  else {
+    printHeader(num,sizeResult,speedResult,_only_use_a,div);
+  }
+  printlines();
+  phaseEnd(_phase_generate);
+}
+
+
+// Find a fraction multiplication value/2^power equivalent to the desired division
+// for inputs from 0 to maxInput. Returns 0 if there is none.
+int findMultiplierRange(float i,int maxInput,int *value,int *power) {
   int dividerBase2;
   int div;
-  int value;
   int correct;
-  for (dividerBase2=0;dividerBase2<=MAXPOWER2;dividerBase2++) {
+  long long num;
+  long long den;
+  int found=0;
+  phaseBegin(_phase_search);
+  exactDivisor(i,&num,&den);
+  for (dividerBase2=0;(dividerBase2<=MAXPOWER2)&&!found;dividerBase2++) {
     div=1<<dividerBase2;
-    value=(div/i)+1;
+    *value=(div*den)/num+1;
+    *power=dividerBase2;
     correct=1;
-    for (int j=0;j<256;j++) { // test approximation for all 256 numbers
-      if ( (int)((j*1000)/(i*1000)) != ((value*j)/div) ) {
+    for (int j=0;j<=maxInput;j++) { // test approximation for all input numbers
+      if ( (j*den)/num != ((long long)*value*j)/div ) {
         correct=0;  // if an error found mark as incorrect
-        j=256;
+        j=maxInput+1;
       }
     }
+    countCandidate(correct);
     if (i==div) {  //if number is a power of two
-       generateCode(div,1,0,dividerBase2);
-       dividerBase2=200;  // exit for loop
+       *value=1;
+       found=1;
+    }
+    else if (correct==1) found=1; // approximation works
+  }
+  phaseEnd(_phase_search);
+  return found;
+}
+
+// Find a fraction multiplication equivalent to the desired division
+int findMultiplier(float i,int *value,int *power) {
+  return findMultiplierRange(i,255,value,power);
+}
+
+// Verifies candidates of findChain16, taking the next one not verified yet,
+// until the next one can't be better than the first one found correct. It
+// stops verifying a candidate as soon as a better one is found.
+void *verifyWide(void *unused) {
+  int c;
+  int correct;
+  int cancelled;
+  (void)unused;
+  while (1) {
+    pthread_mutex_lock(&wideLock);
+    c=wideNext++;
+    cancelled=(c>=numWide)||(c>wideFound);
+    pthread_mutex_unlock(&wideLock);
+    if (cancelled) return NULL;
+    correct=1;
+    for (long long j=0;(j<=wideMaxInput)&&correct;j++) { // test approximation for all input numbers
+      if ( ((j*wideM[c])>>wideS[c]) != (j*wideDen)/wideNum ) correct=0;
+      if (((j&0xFFF)==0xFFF)&&correct) {
+        pthread_mutex_lock(&wideLock);
+        cancelled=(c>wideFound);
+        pthread_mutex_unlock(&wideLock);
+        if (cancelled) break;
+      }
     }
-    if (correct==1) { // approximation works
-       generateCode(i,value,0,dividerBase2);
-       dividerBase2=200;
+    if (cancelled) continue;
+    pthread_mutex_lock(&wideLock);
+    wideStatus[c]=correct?1:2;
+    if (correct&&(c<wideFound)) wideFound=c;
+    pthread_mutex_unlock(&wideLock);
+  }
+}
+
+// Find the cheapest 16 bits chain HL = DE * m / 2^s equivalent to a division
+// by n for DE from 0 to maxInput. Returns 0 if there is none.
+// The candidates are measured in the code buffer, so it must be called
+// before generating the routine. They are sorted by cost and verified by
+// numThreads threads, so the first correct one is the result whatever the
+// number of threads.
+int findChain16(float n,int maxInput,long long *bestM,int *bestS) {
+  int cost[MAXWIDE];
+  int threads=numThreads;
+  long long first;
+  long long m;
+  int s;
+  int c;
+  pthread_t thread[64];
+  phaseBegin(_phase_search);
+  exactDivisor(n,&wideNum,&wideDen);
+  wideMaxInput=maxInput;
+  numWide=0;
+  for (s=0;s<=MAXPOWER2+8;s++) {
+    first=(((long long)1<<s)*wideDen)/wideNum;
+    for (m=first;m<=first+16;m++) {
+      if (m<=0) continue;
+      resetCode();
+      buildChain16(m,s,0);
+      measureCode();
+      for (c=numWide;(c>0)&&(cost[c-1]>speedResult*1000+sizeResult);c--) { // keep them sorted
+        wideM[c]=wideM[c-1];
+        wideS[c]=wideS[c-1];
+        cost[c]=cost[c-1];
+      }
+      wideM[c]=m;
+      wideS[c]=s;
+      cost[c]=speedResult*1000+sizeResult;
+      wideStatus[numWide]=0;
+      numWide++;
     }
   }
+  wideNext=0;
+  wideFound=numWide;
+  if (threads<=0) threads=sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads<1) threads=1;
+  if (threads>64) threads=64;
+  for (int t=1;t<threads;t++) {
+    if (pthread_create(&thread[t],NULL,verifyWide,NULL)!=0) threads=t;
+  }
+  verifyWide(NULL);
+  for (int t=1;t<threads;t++) pthread_join(thread[t],NULL);
+  for (c=0;c<numWide;c++) countCandidate(wideStatus[c]==1);
+  phaseEnd(_phase_search);
+  if (wideFound==numWide) return 0;
+  *bestM=wideM[wideFound];
+  *bestS=wideS[wideFound];
+  return 1;
+}
+
+// Find a fraction multiplication equivalent to the desired division
+void findApproximation(float i) {
+  int value;
+  int power;
+  if (findMultiplier(i,&value,&power)) generateCode(i,value,0,power);
 }
 
 // if a number is a power of two, returns exponent+1. If not, returns 0.
@@ -422,39 +2307,55 @@ int isPowerOf2(int num) {
 }
 
 // Creates a division function for numbers bigger than 128 up to 255
-void numberBigger128UpTo255(float num) {
+void addNumberBigger128UpTo255(float num) {
   int integernum;
   integernum=num;
   if (integernum!=num) integernum++;  // adjust for non-integers
-  printHeader(num,5,7,_only_use_a,0);
-  printf("cp #%-3d   ; [2]\n", integernum);
-  printf("sbc a     ; [1]\n");
-  printf("inc a     ; [1]\n");
-  printf("ret       ; [3]\n");
+  addLineOp(_cp_n,integernum,0);
+  addLineOp(_sbc_r,_reg_a,0);
+  addLineOp(_inc_r,_reg_a,0);
+  addLine(_ret);
+}
+void numberBigger128UpTo255(float num) {
+  resetCode();
+  addNumberBigger128UpTo255(num);
+  finishCode(num,0);
+  printHeader(num,sizeResult,speedResult,_only_use_a,0);
+  printlines();
 }
 
 // Creates a division function for numbers bigger than 85 and smaller than 128
-void numberBigger85Smaller128(float num) {
+void addNumberBigger85Smaller128(float num) {
   int integernum;
   int doublenum;
   integernum=num;
   if (integernum!=num) integernum++;
+  char name[32];
+  int moreThan;
   doublenum=num*2;
   if (doublenum!=num*2) doublenum++;
+  sprintf(name,"more_than_%d",doublenum-1);
+  moreThan=newLabel(name);
+  addLineOp(_cp_n,doublenum,0);
+  addLineOp(_jr_nc,moreThan,0);
+  addLineOp(_cp_n,integernum,0);
+  addLineOp(_sbc_r,_reg_a,0);
+  addLineOp(_inc_r,_reg_a,0);
+  addLine(_ret);
+  addLineOp(_label,moreThan,0);
+  addLineOp(_ld_r_n,_reg_a,2);
+  addLine(_ret);
+}
+void numberBigger85Smaller128(float num) {
+  resetCode();
+  addNumberBigger85Smaller128(num);
+  finishCode(num,0);
   printHeaderNumberBigger85Smaller128(num);
-  printf("cp #%-3d   ; [2]\n", doublenum);
-  printf("jr nc,more_than_%-3d ; [2/3]\n",doublenum-1);
-  printf("cp #%-3d   ; [2]\n", integernum);
-  printf("sbc a     ; [1]\n");
-  printf("inc a     ; [1]\n");
-  printf("ret       ; [3]\n");
-  printf("more_than_%d:\n",doublenum-1);
-  printf("ld a,#2   ; [2]\n");
-  printf("ret       ; [3]\n");
+  printlines();
 }
 
 // Creates a division function for numbers bigger than 64 up to 85
-void numberBigger64UpTo85(float num) {
+void addNumberBigger64UpTo85(float num) {
   int integernum;
   int doublenum;
   int triplenum;
@@ -462,78 +2363,3088 @@ void numberBigger64UpTo85(float num) {
   if (num!=integernum) integernum++;
   doublenum=num*2;
   if (doublenum!=num*2) doublenum++;
+  char name[32];
+  int lessThan;
   triplenum=num*3;
   if (triplenum!=num*3) triplenum++;
-  printHeader(num,15,12,_only_use_a,0);
-  printf("cp #%-3d   ; [2]\n", doublenum);
-  printf("jr c,less_than_%-3d ; [2/3]\n",doublenum);
-  printf("cp #%-3d   ; [2]\n", triplenum);
-  printf("sbc a     ; [1]\n");
-  printf("add #3    ; [2]\n");
-  printf("ret       ; [3]\n");
-  printf("less_than_%d:\n",doublenum);
-  printf("cp #%-3d   ; [2]\n", integernum);
-  printf("sbc a     ; [1]\n");
-  printf("inc a     ; [1]\n");
-  printf("ret       ; [3]\n");
+  sprintf(name,"less_than_%d",doublenum);
+  lessThan=newLabel(name);
+  addLineOp(_cp_n,doublenum,0);
+  addLineOp(_jr_c,lessThan,0);
+  addLineOp(_cp_n,triplenum,0);
+  addLineOp(_sbc_r,_reg_a,0);
+  addLineOp(_add_n,3,0);
+  addLine(_ret);
+  addLineOp(_label,lessThan,0);
+  addLineOp(_cp_n,integernum,0);
+  addLineOp(_sbc_r,_reg_a,0);
+  addLineOp(_inc_r,_reg_a,0);
+  addLine(_ret);
+}
+void numberBigger64UpTo85(float num) {
+  resetCode();
+  addNumberBigger64UpTo85(num);
+  finishCode(num,0);
+  printHeader(num,sizeResult,timeWorst,_only_use_a,0);
+  printlines();
 }
 
-// Main function
-int main(int argc, char **argv) {
-  float num;
-  float param1;
-  float param2;
-  if (argc==1) {
-    printHelp();
-    return 1;
+// Creates a division function by num, choosing the method by its range
+void divisionRoutine(float num) {
+  if ((num>128)&&(num<=255)) numberBigger128UpTo255(num);
+  else if ((num>85)&&(num<128)) numberBigger85Smaller128(num);
+  else if ((num>64)&&(num<=85)) numberBigger64UpTo85(num);
+  else findApproximation(num);
+}
+
+// Adds the code (ending in 'ret') of the function that divisionRoutine
+// (div==0) or generateCode would create, without finishing it. Labels are
+// made local, so several versions can be in the same source.
+// Returns 0 if there is none.
+int buildRoutine(float num,int div) {
+  int value;
+  int power;
+  resetCode();
+  if (div!=0) buildChain(num,isPowerOf2(div)-1);
+  else if ((num>128)&&(num<=255)) addNumberBigger128UpTo255(num);
+  else if ((num>85)&&(num<128)) addNumberBigger85Smaller128(num);
+  else if ((num>64)&&(num<=85)) addNumberBigger64UpTo85(num);
+  else if (findMultiplier(num,&value,&power)) buildChain(value,power);
+  else return 0;
+  if (resultLines[numResultLines-1]!=_ret) addLine(_ret);
+  for (int l=0;l<numLabels;l++) sprintf(labelNames[l],"%d$",l+1);
+  return 1;
+}
+
+// Creates a function that returns the byte offset and the pixel mask of the
+// pixel x in a screen line of the given mode. Input x is taken from A when
+// maxX<256 or from DE otherwise. If addHL is set, the offset is added to HL.
+void screenAddress(int mode,int maxX,int addHL) {
+  int pixelsPerByte;
+  int mask;
+  int maxValue;
+  int label;
+  int x;
+  int base;
+  int expectedMask;
+  pixelsPerByte=2<<mode;
+  if (mode==0) mask=0xAA;
+  else if (mode==1) mask=0x88;
+  else mask=0x80;
+  resetCode();
+  if (maxX>255) addLineOp(_ld_r_r,_reg_a,_reg_e);
+  addLineOp(_ld_r_n,_reg_c,mask);  // mask of the leftmost pixel
+  if (mode==2) { // moving the mask 4 pixels is cheaper testing bit 2 before shifting
+    label=newLabel(NULL);
+    addLineOp(_bit_r,_reg_a,2);
+    addLineOp(_jr_z,label,0);
+    addLineOp(_ld_r_n,_reg_c,mask>>4);
+    addLineOp(_label,label,0);
   }
-  param1=atof(argv[1]);
-  if (argc>2) {
-    param2=atof(argv[2]);
-    if (param1==0) {
-      if (param2<1) {
-        printf("Divisor must be greater than or equal to 1.\n");
-        return 1;
-      }
-      showInfo(param2);
+  maxValue=maxX;
+  for (int bit=0;bit<=mode;bit++) {
+    if (maxValue>255) { // bit 8 of x is in D
+      addLineOp(_srl_r,_reg_d,0);
+      addLine(_rra);
     }
     else {
-      num=isPowerOf2(param2);
-      if (num==0) {
-        printf("Divisor must be a power of 2.\n");
-        return 1;
-      }
-      if (param1>param2) {
-        printf("Divisor must be greater than or equal to dividend.\n");
-        return 1;
-      }
-      if ((param1!=atoi(argv[1]))||(param1<0)) {
-        printf("Dividend must be a positive integer.\n");
-        return 1;
+      addLine(_srl_a);
+    }
+    maxValue>>=1;
+    if (bit<2) { // shifted out bit goes to carry, move mask if it is set
+      label=newLabel(NULL);
+      addLineOp(_jr_nc,label,0);
+      for (int j=0;j<(1<<bit);j++) addLineOp(_rrc_r,_reg_c,0);
+      addLineOp(_label,label,0);
+    }
+  }
+  if (addHL) { // HL = HL + A
+    addLineOp(_add_r,_reg_l,0);
+    addLineOp(_ld_r_r,_reg_l,_reg_a);
+    addLineOp(_adc_r,_reg_h,0);
+    addLineOp(_sub_r,_reg_l,0);
+    addLineOp(_ld_r_r,_reg_h,_reg_a);
+  }
+  addLine(_ret);
+  measureCode();
+  resetTimes();
+  for (x=0;x<=maxX;x++) { // test all pixels
+    base=0xC000+((x*37)&0x7FF);
+    z80Reg[_reg_a]=x;
+    z80Reg[_reg_d]=x>>8;
+    z80Reg[_reg_e]=x;
+    z80Reg[_reg_h]=base>>8;
+    z80Reg[_reg_l]=base;
+    z80Reg[_reg_c]=0;
+    addTime(runCode());
+    if (mode==0) expectedMask=(x&1)?0x55:0xAA;
+    else expectedMask=mask>>(x%pixelsPerByte);
+    if ( (z80Reg[_reg_c]!=expectedMask) ||
+         ( addHL && (z80Reg[_reg_h]*256+z80Reg[_reg_l]!=base+x/pixelsPerByte) ) ||
+         ( !addHL && (z80Reg[_reg_a]!=x/pixelsPerByte) ) ) {
+      printf(";;---ERROR screenAddress: fails for x=%d---\n",x);
+      break;
+    }
+  }
+  printf(";;\n");
+  printf(";; Screen byte and pixel mask for mode %d\n",mode);
+  printf(";;\n;; Returns the byte offset and the pixel mask\n");
+  printf(";; of the pixel x (0..%d) in a mode %d screen line\n",maxX,mode);
+  if (addHL) printf(";;\n;;   HL = HL + x / %d\n",pixelsPerByte);
+  else printf(";;\n;;    A = x / %d\n",pixelsPerByte);
+  printf(";;    C = pixel mask\n;;\n");
+  printf(";;   Input: %s register (x)\n",(maxX>255)?"DE":"A");
+  if (addHL) printf(";;  Output: HL register (address), C register (mask)\n");
+  else printf(";;  Output: A register (offset), C register (mask)\n");
+  printDestroyed(addHL?(1<<_reg_h)|(1<<_reg_l)|(1<<_reg_c):(1<<_reg_a)|(1<<_reg_c));
+  printf(";;\n");
+  printTimes();
+  printCredits();
+  printf("screen_mode%d_%d%s::\n",mode,maxX,addHL?"_hl":"");
+  printlines();
+}
+
+// Generates the chain of one of the results of a multiple result function,
+// keeping it in targetLines[] without the initial 'ld b,a'. Returns 0 on failure.
+int buildTarget(int t) {
+  int value;
+  int power;
+  resetCode();
+  if (targetDiv[t]!=0) {
+    buildChain(targetNum[t],isPowerOf2(targetDiv[t])-1);
+  }
+  else {
+    if (!findMultiplier(targetNum[t],&value,&power)) return 0;
+    buildChain(value,power);
+  }
+  targetLength[t]=0;
+  for (int i=0;i<numResultLines;i++) {
+    if (resultLines[i]==_ld_ba) targetsUseB=1;
+    else targetLines[t][targetLength[t]++]=resultLines[i];
+  }
+  return 1;
+}
+
+// Returns a free register to keep a value, or -1. The halves of IX and IY
+// are used with --undocumented.
+int getFreeRegister(void) {
+  int order[]={_reg_c,_reg_d,_reg_e,_reg_h,_reg_l,_reg_b,_reg_ixl,_reg_ixh,_reg_iyl,_reg_iyh};
+  for (int i=0;i<(undocumented?10:6);i++) {
+    if (!registerBusy[order[i]]) {
+      registerBusy[order[i]]=1;
+      registerDestroyed[order[i]]=1;
+      return order[i];
+    }
+  }
+  return -1;
+}
+
+// Emits the chains of a group of results that share their first 'pos' lines.
+// Common lines are emitted only once, A is saved where the chains diverge.
+// Returns 0 if there are not enough free registers.
+int emitTargets(int *group,int numGroup,int pos) {
+  int remaining[MAXTARGETS];
+  int numRemaining;
+  int part[MAXTARGETS];
+  int numPart;
+  int done[MAXTARGETS];
+  int save;
+  int last;
+  int first;
+  while (1) {
+    numRemaining=0;
+    for (int k=0;k<numGroup;k++) { // store results that end here
+      if (targetLength[group[k]]>pos) remaining[numRemaining++]=group[k];
+      else if (targetReg[group[k]]!=_reg_a) addLineOp(_ld_r_r,targetReg[group[k]],_reg_a);
+    }
+    for (int k=0;k<numGroup;k++) {
+      if ((targetLength[group[k]]==pos)&&(targetReg[group[k]]==_reg_a)&&(numRemaining>0)) {
+        resultInA=getFreeRegister();  // result for A is needed later, keep it
+        if (resultInA<0) return 0;
+        addLineOp(_ld_r_r,resultInA,_reg_a);
       }
-      generateCode(param1,param1,param2,num-1);
     }
+    if (numRemaining==0) return 1;
+    for (int k=0;k<numRemaining;k++) group[k]=remaining[k];
+    numGroup=numRemaining;
+    first=targetLines[group[0]][pos];
+    for (int k=1;k<numGroup;k++) if (targetLines[group[k]][pos]!=first) first=-1;
+    if (first<0) break;
+    addLine(first);  // all chains share this line
+    pos++;
   }
+  if ((pos==0)&&targetsUseB) save=_reg_b;  // input value is already in B
   else {
-    num=param1;
-    if (num<=-1){
-      findApproximation(-num);
+    save=getFreeRegister();
+    if (save<0) return 0;
+    addLineOp(_ld_r_r,save,_reg_a);
+  }
+  last=-1;
+  for (int k=0;k<numGroup;k++) { // line of the chains which result goes to A
+    if (targetReg[group[k]]==_reg_a) last=targetLines[group[k]][pos];
+  }
+  for (int k=0;k<numGroup;k++) done[k]=0;
+  for (int n=0;n<numGroup;) { // emit each set of chains with the same next line, the one with A result last
+    first=-1;
+    for (int k=0;(k<numGroup)&&(first<0);k++) {
+      if (!done[k]&&(targetLines[group[k]][pos]!=last)) first=targetLines[group[k]][pos];
     }
-    else if (num<1) {
-      printf("Divisor must be greater than or equal to 1.\n");
-      return 1;
+    if (first<0) first=last;
+    numPart=0;
+    for (int k=0;k<numGroup;k++) {
+      if (!done[k]&&(targetLines[group[k]][pos]==first)) {
+        part[numPart++]=group[k];
+        done[k]=1;
+        n++;
+      }
+    }
+    if (!emitTargets(part,numPart,pos)) return 0;
+    if (n<numGroup) addLineOp(_ld_r_r,_reg_a,save);
+  }
+  if (save!=_reg_b) registerBusy[save]=0;
+  return 1;
+}
+
+// Prints the operation computed for one result of a multiple result function
+void printTarget(int t) {
+  if (targetDiv[t]!=0) printf("A * ( %d / %d )",(int)targetNum[t],targetDiv[t]);
+  else printf("A / %g",targetNum[t]);
+}
+
+// Creates a function that returns several divisions or fraction multiplications
+// of the input value, sharing the lines that their chains have in common
+void multipleResults(void) {
+  int group[MAXTARGETS];
+  int separateSize=0;
+  int separateSpeed=0;
+  int failed=-1;
+  char *names[NUMREGISTERS];
+  char *halfNames[]={"IXH","IXL","IYH","IYL"};
+  int numNames;
+  for (int t=0;t<numTargets;t++) { // measure the functions the tool creates for each result
+    if (!buildRoutine(targetNum[t],targetDiv[t])) {
+      printf("No fraction found for divisor %g.\n",targetNum[t]);
+      return;
     }
-    else if ((num>128)&&(num<=255)) {
-      numberBigger128UpTo255(num);
+    finishCode(targetNum[t],targetDiv[t]);
+    separateSize+=sizeResult;
+    separateSpeed+=timeWorst;
+  }
+  for (int t=0;t<numTargets;t++) {
+    if (!buildTarget(t)) {
+      printf("No fraction found for divisor %g.\n",targetNum[t]);
+      return;
     }
-    else if ((num>85)&&(num<128)) {
-      numberBigger85Smaller128(num);
+  }
+  for (int r=0;r<NUMREGISTERS;r++) {
+    registerBusy[r]=(r==_reg_a)||(r==_reg_hl_ind)||(r==_reg_ix_ind)||((r==_reg_b)&&targetsUseB);
+    registerDestroyed[r]=0;
+  }
+  for (int t=0;t<numTargets;t++) {
+    registerBusy[targetReg[t]]=1;
+    group[t]=t;
+  }
+  resultInA=-1;
+  resetCode();
+  if (targetsUseB) addLine(_ld_ba);
+  if (!emitTargets(group,numTargets,0)) {
+    printf("Not enough free registers for these results.\n");
+    return;
+  }
+  if (resultInA>=0) addLineOp(_ld_r_r,_reg_a,resultInA);
+  addLine(_ret);
+  optimizeCode();
+  measureCode();
+  for (int j=0;(j<256)&&(failed<0);j++) { // test all inputs
+    z80Reg[_reg_a]=j;
+    runCode();
+    for (int t=0;t<numTargets;t++) {
+      if (z80Reg[targetReg[t]]!=expectedResult(targetNum[t],targetDiv[t],j)) failed=j;
     }
-    else if ((num>64)&&(num<=85)) {
-      numberBigger64UpTo85(num);
+  }
+  if (failed>=0) printf(";;---ERROR test fails for input %d---\n",failed);
+  if (speedResult>=separateSpeed+5*(numTargets-1)) { // one call against a call for each
+    printf(";; Separate functions are faster: %d bytes / %d microseconds (plus a call for each)\n",separateSize,separateSpeed);
+    printf(";; A single function would take %d bytes / %d microseconds\n",sizeResult,speedResult);
+    return;
+  }
+  printf(";;\n;; Multiple results\n");
+  printf(";;\n;; Returns the integer results of several divisions\n");
+  printf(";; or fraction multiplications of the input value\n;;\n");
+  for (int t=0;t<numTargets;t++) {
+    printf(";;   %c = ",registerNames[targetReg[t]][0]-32);
+    printTarget(t);
+    printf("\n");
+  }
+  printf(";;\n;;   Input: A register\n;;  Output: ");
+  numNames=0;
+  for (int t=0;t<numTargets;t++) {
+    int repeated=0;
+    for (int k=0;k<t;k++) if (targetReg[k]==targetReg[t]) repeated=1;
+    if (!repeated) names[numNames++]=(targetReg[t]==_reg_a)?"A":(targetReg[t]==_reg_c)?"C":(targetReg[t]==_reg_d)?"D":(targetReg[t]==_reg_e)?"E":(targetReg[t]==_reg_h)?"H":"L";
+  }
+  printRegisterList(names,numNames);
+  printf(numNames>1?" registers\n":" register\n");
+  numNames=0;
+  if (targetsUseB) names[numNames++]="B";
+  if (registerDestroyed[_reg_c]) names[numNames++]="C";
+  if (registerDestroyed[_reg_d]) names[numNames++]="D";
+  if (registerDestroyed[_reg_e]) names[numNames++]="E";
+  if (registerDestroyed[_reg_h]) names[numNames++]="H";
+  if (registerDestroyed[_reg_l]) names[numNames++]="L";
+  for (int r=_reg_ixh;r<=_reg_iyl;r++) {
+    if (registerDestroyed[r]) names[numNames++]=halfNames[r-_reg_ixh];
+  }
+  if (numNames>0) {
+    printf(";;\n;; Destroys ");
+    printRegisterList(names,numNames);
+    printf(numNames>1?" registers\n":" register\n");
+  }
+  printf(";;\n;; %d bytes / %d microseconds\n",sizeResult,speedResult);
+  printf(";; Separate functions: %d bytes / %d microseconds (plus a call for each)\n",separateSize,separateSpeed);
+  printf(";; Saves %d bytes / %d microseconds (calls included)\n",separateSize+3*(numTargets-1)-sizeResult,separateSpeed+5*(numTargets-1)-speedResult);
+  printCredits();
+  printf("multiple");
+  for (int t=0;t<numTargets;t++) {
+    if (targetDiv[t]!=0) printf("_%d_%d",(int)targetNum[t],targetDiv[t]);
+    else printf("_%g",targetNum[t]);
+  }
+  printf("::\n");
+  printlines();
+}
+
+// Fills sig[] with the results of a division by num (div==0) or of a
+// multiplication by the fraction num/div for all 256 inputs
+void quotientSignature(float num,int div,unsigned char *sig) {
+  for (int j=0;j<256;j++) sig[j]=expectedResult(num,div,j);
+}
+
+// Finds the divisors giving the results in sig[]: any divisor bigger than
+// *low and up to *high. Returns 0 if no division gives these results.
+int divisorRange(unsigned char *sig,double *low,double *high) {
+  *low=0;
+  *high=1e9;
+  for (int j=1;j<256;j++) { // sig[j] <= j/n < sig[j]+1
+    if ((double)j/(sig[j]+1)>*low) *low=(double)j/(sig[j]+1);
+    if ((sig[j]>0)&&((double)j/sig[j]<*high)) *high=(double)j/sig[j];
+  }
+  return *low<*high;
+}
+
+// Writes the label name of a request of a batch
+void requestName(int r,char *name) {
+  if (requestDiv[r]!=0) sprintf(name,"fraction_%d_%d",(int)requestNum[r],requestDiv[r]);
+  else sprintf(name,"division_by_%g",requestNum[r]);
+}
+
+// Creates the functions for a batch of divisions and fraction multiplications.
+// Requests with the same results for all inputs share one function, which
+// gets a label for each of them.
+void batchRoutines(void) {
+  unsigned char sig[MAXREQUESTS][256];
+  char name[32];
+  char firstName[32];
+  int numClasses=0;
+  int first;
+  int repeated;
+  int saved=0;
+  double low;
+  double high;
+  for (int r=0;r<numRequests;r++) {
+    quotientSignature(requestNum[r],requestDiv[r],sig[r]);
+    requestClass[r]=-1;
+    for (int k=0;(k<r)&&(requestClass[r]<0);k++) {
+      if (memcmp(sig[k],sig[r],256)==0) requestClass[r]=requestClass[k];
+    }
+    if (requestClass[r]<0) requestClass[r]=numClasses++;
+  }
+  for (int c=0;c<numClasses;c++) {
+    first=-1;
+    numAliases=0;
+    for (int r=0;r<numRequests;r++) {
+      if (requestClass[r]!=c) continue;
+      requestName(r,name);
+      if (first<0) {
+        first=r;
+        strcpy(firstName,name);
+        continue;
+      }
+      repeated=(strcmp(name,firstName)==0);
+      for (int k=0;k<numAliases;k++) if (strcmp(name,aliasNames[k])==0) repeated=1;
+      if (!repeated) strcpy(aliasNames[numAliases++],name);
+    }
+    if (divisorRange(sig[first],&low,&high)) {
+      printf(";;\n;; Same results for any divisor bigger than %g",low);
+      if (high<1e9) printf(" and up to %g\n",high);
+      else printf("\n");
+    }
+    if (requestDiv[first]!=0) generateCode(requestNum[first],requestNum[first],requestDiv[first],isPowerOf2(requestDiv[first])-1);
+    else divisionRoutine(requestNum[first]);
+    saved+=sizeResult*numAliases;
+  }
+  numAliases=0;
+  printf(";;\n;; %d requests in %d functions (%d bytes saved)\n;;\n",numRequests,numClasses,saved);
+}
+
+// Adds an input value to HL. Inputs held in a register pair (zero extended)
+// use 'add hl,rr', other inputs are added in 8 bits.
+void addBlendInput(int input,int numInputs,int first) {
+  int pair;
+  int reg;
+  pair=(input==0)?_pair_de:_pair_bc;
+  reg=(input==1)?_reg_b:_reg_c;
+  if ((input==0)||(numInputs==2)) {
+    if (first) {
+      addLineOp(_ld_r_r,_reg_h,pair*2);
+      addLineOp(_ld_r_r,_reg_l,pair*2+1);
+    }
+    else addLineOp(_add_hl_rr,pair,0);
+  }
+  else if (first) {
+    addLineOp(_ld_r_r,_reg_l,reg);
+    addLineOp(_ld_r_n,_reg_h,0);
+  }
+  else {
+    addLineOp(_ld_r_r,_reg_a,_reg_l);
+    addLineOp(_add_r,reg,0);
+    addLineOp(_ld_r_r,_reg_l,_reg_a);
+    addLineOp(_adc_r,_reg_h,0);
+    addLineOp(_sub_r,_reg_l,0);
+    addLineOp(_ld_r_r,_reg_h,_reg_a);
+  }
+}
+
+// Creates a function for the weighted sum (A*w1 + B*w2 [+ C*w3]) / 2^k.
+// The weights are decomposed into powers of two and accumulated in HL,
+// doubling HL between powers, so the result is exact.
+void linearBlend(int numInputs,int *weights,int k) {
+  int top=0;
+  int low=MAXPOWER2;
+  int first=1;
+  int doublings;
+  int shifts;
+  int rotations;
+  int maxSum=0;
+  int failed=-1;
+  int value;
+  int expected;
+  for (int i=0;i<numInputs;i++) {
+    maxSum+=weights[i]*255;
+    for (int bit=0;bit<=MAXPOWER2;bit++) {
+      if ((weights[i]>>bit)&1) {
+        if (bit>top) top=bit;
+        if (bit<low) low=bit;
+      }
+    }
+  }
+  if ((maxSum>>k)>255) {
+    printf("Result must fit in 8 bits (w1+w2+w3 <= 2^k).\n");
+    return;
+  }
+  doublings=(k-low<8)?8-(k-low):0;  // extra doublings to get the result in H
+  shifts=(k-low>8)?k-low-8:0;       // shifts of H still needed
+  if (((maxSum>>low)<<doublings)>65535) {
+    printf("Weights are too big for a 16 bits sum.\n");
+    return;
+  }
+  resetCode();
+  addLineOp(_ld_r_r,_reg_e,_reg_a);  // DE = A
+  addLineOp(_ld_r_n,_reg_d,0);
+  if (numInputs==2) {  // BC = B
+    addLineOp(_ld_r_r,_reg_c,_reg_b);
+    addLineOp(_ld_r_r,_reg_b,_reg_d);
+  }
+  for (int bit=top;bit>=low;bit--) {
+    if (!first) addLineOp(_add_hl_rr,_pair_hl,0);
+    for (int i=0;i<numInputs;i++) {
+      if ((weights[i]>>bit)&1) {
+        addBlendInput(i,numInputs,first);
+        first=0;
+      }
+    }
+  }
+  rotations=8-doublings;
+  if (rotations>4) rotations=8-rotations;
+  if ((doublings>0)&&(4+rotations<3*doublings+1)) {
+    // result is (H << doublings) | (L >> (8-doublings)), join both parts and rotate them
+    addLineOp(_ld_r_r,_reg_a,_reg_l);
+    addLineOp(_and_n,(0xFF<<(8-doublings))&0xFF,0);
+    addLineOp(_or_r,_reg_h,0);
+    for (int i=0;i<rotations;i++) addLine((doublings>=4)?_rrca:_rlca);
+  }
+  else {
+    for (int i=0;i<doublings;i++) addLineOp(_add_hl_rr,_pair_hl,0);
+    addLineOp(_ld_r_r,_reg_a,_reg_h);
+  }
+  for (int i=0;i<shifts;i++) addLine(_srl_a);
+  addLine(_ret);
+  optimizeCode();
+  measureCode();
+  for (int j=0;(j<(1<<(8*numInputs)))&&(failed<0);j++) { // test all input combinations
+    z80Reg[_reg_a]=j&255;
+    z80Reg[_reg_b]=(j>>8)&255;
+    z80Reg[_reg_c]=j>>16;
+    expected=0;
+    for (int i=0;i<numInputs;i++) expected+=weights[i]*((j>>(8*i))&255);
+    runCode();
+    value=z80Reg[_reg_a];
+    if (value!=(expected>>k)) failed=j;
+  }
+  if (failed>=0) printf(";;---ERROR test fails for inputs %d, %d, %d---\n",failed&255,(failed>>8)&255,failed>>16);
+  printf(";;\n;; Linear blend\n");
+  printf(";;\n;; Returns the integer part of the weighted sum\n");
+  printf(";; of the input values\n");
+  printf(";;\n;;   A = ( A * %d + B * %d",weights[0],weights[1]);
+  if (numInputs==3) printf(" + C * %d",weights[2]);
+  printf(" ) / %d\n;;\n",1<<k);
+  if (numInputs==3) printf(";;   Input: A, B and C registers\n");
+  else printf(";;   Input: A and B registers\n");
+  printf(";;  Output: A register\n");
+  printDestroyed(1<<_reg_a);
+  printf(";;\n;; %d bytes / %d microseconds\n",sizeResult,speedResult);
+  printCredits();
+  printf("blend_%d_%d",weights[0],weights[1]);
+  if (numInputs==3) printf("_%d",weights[2]);
+  printf("_%d::\n",1<<k);
+  printlines();
+}
+
+// Returns the expected result of A * 256 / n, rounded to nearest if round is set
+int expectedFixed(float n,int round,int j) {
+  long long num;
+  long long den;
+  exactDivisor(n,&num,&den);
+  if (round) return (j*512*den+num)/(2*num);
+  return (j*256*den)/num;
+}
+
+// Creates a function that returns A / n with 8 fractional bits in HL.
+// Searches the cheapest chain HL = (A*256 + c) * m / 2^s that is exact.
+// The rounding constant c goes in E, so it costs nothing.
+void fixedDivision(float n,int round) {
+  int bestSpeed=-1;
+  int bestSize=0;
+  long long bestM=0;
+  int bestS=0;
+  int bestC=0;
+  long long m;
+  long long first;
+  int correct;
+  int failed=-1;
+  phaseBegin(_phase_search);
+  for (int s=1;s<=MAXPOWER2+8;s++) {
+    first=(long long)(((long long)1<<s)/n);
+    for (m=first;m<=first+16;m++) {
+      if (m<=0) continue;
+      for (int c=round?(int)(n/2)-3:0;c<=(round?(int)(n/2)+3:0);c++) {
+        if ((c<0)||(c>255)) continue;
+        correct=1;
+        for (int j=0;(j<256)&&correct;j++) { // test the approximation for all 256 numbers
+          if ( (((256*j+c)*m)>>s) != expectedFixed(n,round,j) ) correct=0;
+        }
+        countCandidate(correct);
+        if (!correct) continue;
+        resetCode();
+        addLineOp(_ld_r_r,_reg_d,_reg_a);
+        addLineOp(_ld_r_n,_reg_e,c);
+        buildChain16(m,s,0);
+        addLine(_ret);
+        measureCode();
+        if ((bestSpeed<0)||(speedResult<bestSpeed)||((speedResult==bestSpeed)&&(sizeResult<bestSize))) {
+          bestSpeed=speedResult;
+          bestSize=sizeResult;
+          bestM=m;
+          bestS=s;
+          bestC=c;
+        }
+      }
+    }
+  }
+  phaseEnd(_phase_search);
+  if (bestSpeed<0) {
+    printf("No approximation found.\n");
+    return;
+  }
+  resetCode();
+  addLineOp(_ld_r_r,_reg_d,_reg_a);
+  addLineOp(_ld_r_n,_reg_e,bestC);
+  buildChain16(bestM,bestS,0);
+  addLine(_ret);
+  measureCode();
+  for (int j=0;(j<256)&&(failed<0);j++) { // test all inputs
+    z80Reg[_reg_a]=j;
+    runCode();
+    if (z80Reg[_reg_h]*256+z80Reg[_reg_l]!=expectedFixed(n,round,j)) failed=j;
+  }
+  if (failed>=0) printf(";;---ERROR test fails for input %d---\n",failed);
+  printf(";;\n;; Fixed point division by %g\n",n);
+  printf(";;\n;; Returns the quotient of dividing the input value by %g\n",n);
+  printf(";; with 8 fractional bits (%s)\n",round?"rounded to nearest":"truncated");
+  printf(";;\n;;   HL = A * 256 / %g\n;;\n",n);
+  printf(";;   Input: A register\n");
+  printf(";;  Output: HL register (H integer part, L fractional part)\n");
+  printDestroyed((1<<_reg_h)|(1<<_reg_l));
+  printf(";;\n;; %d bytes / %d microseconds\n",sizeResult,speedResult);
+  printCredits();
+  printf("fixed_division_by_%g%s::\n",n,round?"_round":"");
+  printlines();
+}
+
+// Creates a function that tests if A is a multiple of n. For n = odd*2^t,
+// A is a multiple of n only if A*inverse(odd) mod 256, rotated right t
+// times, is not greater than 255/n. Powers of two just test the low bits.
+void divisibilityTest(int n) {
+  int odd;
+  int shifts=0;
+  int inverse=1;
+  int failed=-1;
+  int zeroFlag;
+  odd=n;
+  while ((odd&1)==0) {
+    odd>>=1;
+    shifts++;
+  }
+  while (((odd*inverse)&255)!=1) inverse+=2;
+  zeroFlag=(odd==1);
+  resetCode();
+  if (zeroFlag) {
+    addLineOp(_and_n,n-1,0);
+  }
+  else {
+    buildMultiply8(inverse);
+    for (int i=0;i<shifts;i++) addLine(_rrca);
+    addLineOp(_cp_n,255/n+1,0);
+  }
+  addLine(_ret);
+  optimizeCode();
+  measureCode();
+  for (int j=0;(j<256)&&(failed<0);j++) { // test all inputs
+    z80Reg[_reg_a]=j;
+    runCode();
+    if ((zeroFlag?z80Zero:z80Carry)!=((j%n)==0)) failed=j;
+  }
+  if (failed>=0) printf(";;---ERROR test fails for input %d---\n",failed);
+  printf(";;\n;; Divisibility test by %d\n",n);
+  printf(";;\n;; Tests if the input value is a multiple of %d\n",n);
+  printf(";;\n;;   %s = A is a multiple of %d\n;;\n",zeroFlag?"Zero":"Carry",n);
+  printf(";;   Input: A register\n");
+  printf(";;  Output: %s flag (set if A is a multiple of %d)\n",zeroFlag?"Zero":"Carry",n);
+  printDestroyed(0);
+  printf(";;\n;; %d bytes / %d microseconds\n",sizeResult,speedResult);
+  printCredits();
+  printf("is_multiple_of_%d::\n",n);
+  printlines();
+}
+
+// Add the code for A = A / n, for A from 0 to maxInput. Uses B register.
+void addDivisionChain(float n,int maxInput) {
+  int value;
+  int power;
+  if (findMultiplierRange(n,maxInput,&value,&power)==0) {
+    printf(";;---ERROR no chain for %g---\n",n);
+    return;
+  }
+  buildChain(value,power);
+}
+
+// Add the code for converting A (from 0 to 99) to packed BCD, leaving it in
+// A and in register reg. As A = 10*tens + ones, the packed value
+// 16*tens + ones is just A + 6*tens. Uses B register.
+void addPackedBcd(int reg) {
+  addLineOp(_ld_r_r,reg,_reg_a);
+  addDivisionChain(10,99);
+  addLine(_ld_ba);
+  addLineOp(_add_r,_reg_a,0);
+  addLine(_add_b);
+  addLineOp(_add_r,_reg_a,0);
+  addLineOp(_add_r,reg,0);
+  addLineOp(_ld_r_r,reg,_reg_a);
+}
+
+// Add the code for writing the ASCII digit in register reg (high nibble if
+// high is set) to (HL). HL is incremented unless it's the last digit.
+void addAsciiDigit(int reg,int packed,int high,int last) {
+  addLineOp(_ld_r_r,_reg_a,reg);
+  if (high) for (int i=0;i<4;i++) addLine(_rrca);
+  if (packed) addLineOp(_and_n,0x0F,0);
+  addLineOp(_add_n,'0',0);
+  addLineOp(_ld_r_r,_reg_hl_ind,_reg_a);
+  if (!last) addLineOp(_inc_rr,_pair_hl,0);
+}
+
+// Creates a function that converts A (bits=8) or HL (bits=16) to decimal
+// digits. The hundreds are split first, and each remainder below 100 gives
+// two packed BCD digits at once, so every digit is the result of a division
+// chain shared with the next one.
+void decimalConversion(int bits,int ascii) {
+  long long m;
+  int shift;
+  int failed=-1;
+  int digits[5];
+  int numDigits=(bits==8)?3:5;
+  if (bits==16) findChain16(100,65535,&m,&shift);
+  resetCode();
+  if (bits==8) {
+    addLineOp(_ld_r_r,_reg_e,_reg_a);
+    addDivisionChain(100,255);        // hundreds
+    addLineOp(_ld_r_r,_reg_c,_reg_a);
+    buildMultiply8(100);
+    addLine(_neg);
+    addLineOp(_add_r,_reg_e,0);       // A = input - 100 * hundreds
+    addPackedBcd(_reg_e);
+    if (ascii) {
+      addAsciiDigit(_reg_c,0,0,0);
+      addAsciiDigit(_reg_e,1,1,0);
+      addAsciiDigit(_reg_e,1,0,1);
+    }
+  }
+  else {
+    if (ascii) addLineOp(_push_rr,_pair_de,0);
+    addLine(_ex_de_hl);
+    buildChain16(m,shift,0);          // HL = input / 100
+    addLineOp(_ld_r_r,_reg_a,_reg_l);
+    buildMultiply8(100);
+    addLine(_neg);
+    addLineOp(_add_r,_reg_e,0);       // A = input - 100 * (input / 100)
+    addPackedBcd(_reg_e);
+    addLineOp(_ld_r_r,_reg_a,_reg_l);
+    for (int i=0;i<2;i++) {
+      addLineOp(_srl_r,_reg_h,0);
+      addLine(_rra);
+    }
+    addDivisionChain(25,163);         // (input / 100) / 4 / 25
+    addLineOp(_ld_r_r,_reg_c,_reg_a);
+    buildMultiply8(100);
+    addLine(_neg);
+    addLineOp(_add_r,_reg_l,0);       // A = input / 100 - 100 * (input / 10000)
+    addPackedBcd(_reg_d);
+    if (ascii) {
+      addLineOp(_pop_rr,_pair_hl,0);
+      addAsciiDigit(_reg_c,0,0,0);
+      addAsciiDigit(_reg_d,1,1,0);
+      addAsciiDigit(_reg_d,1,0,0);
+      addAsciiDigit(_reg_e,1,1,0);
+      addAsciiDigit(_reg_e,1,0,1);
+    }
+  }
+  addLine(_ret);
+  optimizeCode();
+  measureCode();
+  for (int j=0;(j<(1<<bits))&&(failed<0);j++) { // test all inputs
+    if (bits==8) {
+      z80Reg[_reg_a]=j;
+      z80Reg[_reg_h]=0x90;
+      z80Reg[_reg_l]=0x00;
+    }
+    else {
+      z80Reg[_reg_h]=j>>8;
+      z80Reg[_reg_l]=j;
+      z80Reg[_reg_d]=0x90;
+      z80Reg[_reg_e]=0x00;
+    }
+    runCode();
+    for (int i=0,k=j;i<numDigits;i++,k/=10) digits[numDigits-1-i]=k%10;
+    if (ascii) {
+      for (int i=0;i<numDigits;i++) {
+        if (z80Memory[0x9000+i]!='0'+digits[i]) failed=j;
+      }
+    }
+    else if (bits==8) {
+      if ((z80Reg[_reg_c]!=digits[0])||(z80Reg[_reg_a]!=digits[1]*16+digits[2])) failed=j;
+    }
+    else {
+      if ((z80Reg[_reg_c]!=digits[0])||(z80Reg[_reg_d]!=digits[1]*16+digits[2])||
+          (z80Reg[_reg_e]!=digits[3]*16+digits[4])) failed=j;
+    }
+  }
+  if (failed>=0) printf(";;---ERROR test fails for input %d---\n",failed);
+  printf(";;\n;; %d-bit decimal conversion\n",bits);
+  printf(";;\n;; Converts the input value to %d decimal digits (%s)\n",numDigits,ascii?"ASCII":"BCD");
+  if (bits==8) {
+    printf(";;\n;;   Input: A register\n");
+    if (ascii) {
+      printf(";;  Output: 3 ASCII digits written to (HL), HL points to the last one\n");
+      printDestroyed((1<<_reg_h)|(1<<_reg_l));
+    }
+    else {
+      printf(";;  Output: C = hundreds, A = tens and ones (packed BCD)\n");
+      printDestroyed((1<<_reg_c)|(1<<_reg_a));
+    }
+  }
+  else {
+    if (ascii) {
+      printf(";;\n;;   Input: HL register, DE = address of the buffer\n");
+      printf(";;  Output: 5 ASCII digits written to (DE), HL points to the last one\n");
+      printDestroyed((1<<_reg_h)|(1<<_reg_l));
+    }
+    else {
+      printf(";;\n;;   Input: HL register\n");
+      printf(";;  Output: C = ten thousands, D = thousands and hundreds (packed BCD),\n");
+      printf(";;          E = tens and ones (packed BCD)\n");
+      printDestroyed((1<<_reg_c)|(1<<_reg_d)|(1<<_reg_e));
+    }
+  }
+  printf(";;\n;; %d bytes / %d microseconds\n",sizeResult,speedResult);
+  printCredits();
+  printf("decimal_%d_%s::\n",bits,ascii?"ascii":"bcd");
+  printlines();
+}
+
+// Add the code for A = X * m / 2^s, where X is the 9 bits value carry:A.
+// The first 'rra' leaves Y = X / 2 in A and B and the lost bit in C, and the
+// chain works at half scale: each step is ((h / 2^(d-1)) + C) / 2 + B, so the
+// 9th bit of every sum goes on through the next 'rra'. When two powers of two
+// are consecutive, the sum is still 9 bits wide, so C is only added after
+// the 'rra' if the bit shifted out was set. Returns 0 if m can't be built.
+int buildChain9(long long m,int s) {
+  int powers[64];
+  int numPowers=0;
+  int nine=0;
+  int label;
+  for (int bit=0;bit<63;bit++) {
+    if ((m>>bit)&1) powers[numPowers++]=bit;
+  }
+  if ((numPowers==0)||(s<=powers[numPowers-1])) return 0;
+  if (numPowers==1) {
+    addLine(_rra);
+    for (int i=1;i<s-powers[0];i++) addLine(_srl_a);
+    return 1;
+  }
+  addLineOp(_ld_r_n,_reg_c,0);
+  addLine(_rra);
+  addLineOp(_rl_r,_reg_c,0);
+  addLine(_ld_ba);
+  for (int k=1;k<numPowers;k++) {
+    if ((powers[k]-powers[k-1]==1)&&nine) { // (h + C) / 2 when h is 9 bits wide
+      label=newLabel(NULL);
+      addLine(_rra);
+      addLineOp(_jr_nc,label,0);
+      addLineOp(_add_r,_reg_c,0);
+      addLineOp(_label,label,0);
+    }
+    else {
+      for (int i=0;i<powers[k]-powers[k-1]-1;i++) addLine(((i==0)&&nine)?_rra:_srl_a);
+      addLineOp(_add_r,_reg_c,0);
+      addLine(_rra);
+    }
+    addLine(_add_b);
+    nine=1;
+  }
+  for (int i=0;i<s-powers[numPowers-1]-1;i++) addLine((i==0)?_rra:_srl_a);
+  return 1;
+}
+
+// Tests the generated code for all 9 bits inputs, gathering its times.
+// Returns the first input that fails, or -1.
+int testCode9(float n) {
+  resetTimes();
+  for (int j=0;j<512;j++) {
+    z80Reg[_reg_a]=j;
+    z80Carry=j>>8;
+    addTime(runCode());
+    if (z80Reg[_reg_a]!=exactQuotient(n,j)) return j;
+  }
+  return -1;
+}
+
+// Creates a function that divides the 9 bits value carry:A by n. Chains on
+// Y = X / 2 are tried (exact for even n), and chains which carry the lost
+// bit along; the cheapest one that passes all 512 inputs is used. Widening to
+// HL is the fallback, and its cost is shown for comparison.
+void nineBitDivision(float n) {
+  long long m;
+  int shift;
+  int value;
+  int bestKind=-1;
+  int bestValue=0;
+  int bestPower=0;
+  int bestSpeed=0;
+  int bestSize=0;
+  int wideSize;
+  int wideSpeed;
+  int correct;
+  findChain16(n,511,&m,&shift);
+  resetCode();
+  addLineOp(_ld_r_r,_reg_e,_reg_a);
+  addLineOp(_ld_r_n,_reg_a,0);
+  addLine(_rla);
+  addLineOp(_ld_r_r,_reg_d,_reg_a);
+  buildChain16(m,shift,0);
+  addLineOp(_ld_r_r,_reg_a,_reg_l);
+  addLine(_ret);
+  measureCode();
+  wideSize=sizeResult;
+  wideSpeed=speedResult;
+  for (int kind=0;kind<2;kind++) {
+    for (int power=0;power<=MAXPOWER2;power++) {
+      for (int k=0;k<4;k++) {
+        value=(int)((1<<power)/(kind?n:n/2))+k;
+        if (value<=0) continue;
+        if (kind==1) { // check the approximation before building it
+          correct=1;
+          for (long long j=0;(j<512)&&correct;j++) {
+            if (((j*value)>>power)!=exactQuotient(n,j)) correct=0;
+          }
+          countCandidate(correct);
+          if (!correct) continue;
+        }
+        resetCode();
+        if (kind==0) {
+          addLine(_rra);
+          buildChain(value,power);
+        }
+        else if (buildChain9(value,power)==0) continue;
+        addLine(_ret);
+        optimizeCode();
+        measureCode();
+        if (testCode9(n)>=0) continue;
+        if ((bestKind>=0)&&((timeWorst>bestSpeed)||((timeWorst==bestSpeed)&&(sizeResult>=bestSize)))) continue;
+        bestKind=kind;
+        bestValue=value;
+        bestPower=power;
+        bestSpeed=timeWorst;
+        bestSize=sizeResult;
+      }
+    }
+  }
+  resetCode();
+  if (bestKind==0) {
+    addLine(_rra);
+    buildChain(bestValue,bestPower);
+  }
+  else if (bestKind==1) {
+    buildChain9(bestValue,bestPower);
+  }
+  else {
+    addLineOp(_ld_r_r,_reg_e,_reg_a);
+    addLineOp(_ld_r_n,_reg_a,0);
+    addLine(_rla);
+    addLineOp(_ld_r_r,_reg_d,_reg_a);
+    buildChain16(m,shift,0);
+    addLineOp(_ld_r_r,_reg_a,_reg_l);
+  }
+  addLine(_ret);
+  optimizeCode();
+  measureCode();
+  value=testCode9(n);
+  if (value>=0) printf(";;---ERROR test fails for input %d---\n",value);
+  printf(";;\n;; 9-bit division by %g\n",n);
+  printf(";;\n;; Returns the integer quotient of dividing\n");
+  printf(";; the 9-bit input value by %g\n",n);
+  printf(";;\n;;   A = (carry * 256 + A) / %g\n;;\n",n);
+  printf(";;   Input: A register and carry flag (bit 8)\n");
+  printf(";;  Output: A register\n");
+  printDestroyed(1<<_reg_a);
+  printf(";;\n");
+  printTimes();
+  if (bestKind>=0) printf(";; (widening to HL takes %d bytes / %d microseconds)\n",wideSize,wideSpeed);
+  printCredits();
+  printf("division_9bit_by_%g::\n",n);
+  printlines();
+}
+
+// Find the cheapest 16 bits chain HL = DE * m / 2^s equivalent to a division
+// by the integer n for DE from 0 to maxInput. With m = 2^s/n rounded up and
+// e = m*n - 2^s, the error DE*e/(n*2^s) stays below 1/n when maxInput*e < 2^s,
+// so the quotient is exact without testing every input.
+int findMagic16(int n,long long maxInput,long long *bestM,int *bestS) {
+  int bestSpeed=-1;
+  int bestSize=0;
+  long long m;
+  long long e;
+  for (int s=0;s<=MAXPOWER2+8;s++) {
+    m=(((long long)1<<s)+n-1)/n;
+    for (int k=0;k<4;k++,m++) {
+      e=m*n-((long long)1<<s);
+      countCandidate(maxInput*e<((long long)1<<s));
+      if (maxInput*e>=((long long)1<<s)) break;
+      resetCode();
+      buildChain16(m,s,0);
+      measureCode();
+      if ((bestSpeed<0)||(speedResult<bestSpeed)||((speedResult==bestSpeed)&&(sizeResult<bestSize))) {
+        bestSpeed=speedResult;
+        bestSize=sizeResult;
+        *bestM=m;
+        *bestS=s;
+      }
+    }
+  }
+  return bestSpeed>=0;
+}
+
+// Tests the long division routine with a dividend. Returns 0 if it fails.
+int testLong(long long n,int bits,unsigned long long x) {
+  unsigned long long result=0;
+  int bytes=bits/8;
+  for (int i=0;i<bytes;i++) z80Memory[0x9000+i]=x>>(i*8);
+  z80Reg[_reg_h]=0x90;
+  z80Reg[_reg_l]=0x00;
+  addTime(runCode());
+  for (int i=0;i<bytes;i++) result|=(unsigned long long)z80Memory[0x9000+i]<<(i*8);
+  if (result!=x/n) return 0;
+  if ((n<256)&&(z80Reg[_reg_a]!=x%n)) return 0;
+  return 1;
+}
+
+// Creates a function that divides the 16, 24 or 32 bits number at (HL) by
+// n, byte by byte from the most significant one like a long division: the
+// remainder of each step and the next byte make a 16 bits value below n*256,
+// divided with a chain whose multiplier is proved exact for that range.
+// Divisors above 255 are split as odd*2^t, shifting the dividend first.
+void longDivision(long long n,int bits) {
+  long long m;
+  int shift;
+  int bytes=bits/8;
+  int powers=0;
+  int odd=n;
+  int failed=0;
+  unsigned long long x;
+  unsigned long long mask=(bits==64)?~0ULL:((1ULL<<bits)-1);
+  unsigned long long seed=12345;
+  while (odd>255) {
+    odd>>=1;
+    powers++;
+  }
+  findMagic16(odd,(long long)odd*256-1,&m,&shift);
+  resetCode();
+  for (int i=1;i<bytes;i++) addLineOp(_inc_rr,_pair_hl,0);
+  for (int p=0;p<powers;p++) { // dividend = dividend / 2
+    addLineOp(_srl_r,_reg_hl_ind,0);
+    for (int i=1;i<bytes;i++) {
+      addLineOp(_dec_rr,_pair_hl,0);
+      addLineOp(_rr_r,_reg_hl_ind,0);
+    }
+    if (p<powers-1) for (int i=1;i<bytes;i++) addLineOp(_inc_rr,_pair_hl,0);
+  }
+  if (powers>0) for (int i=1;i<bytes;i++) addLineOp(_inc_rr,_pair_hl,0);
+  addLineOp(_ld_r_r,_reg_b,_reg_h);
+  addLineOp(_ld_r_r,_reg_c,_reg_l);
+  addLineOp(_ld_r_n,_reg_d,0);
+  for (int i=0;i<bytes;i++) {
+    addLineOp(_ld_a_ind,_pair_bc,0);
+    addLineOp(_ld_r_r,_reg_e,_reg_a);  // DE = remainder * 256 + byte
+    buildChain16(m,shift,0);
+    addLineOp(_ld_r_r,_reg_a,_reg_l);
+    addLineOp(_ld_ind_a,_pair_bc,0);
+    buildMultiplyReg(odd,_reg_l,0);
+    addLine(_neg);
+    addLineOp(_add_r,_reg_e,0);         // A = remainder
+    if (i<bytes-1) {
+      addLineOp(_ld_r_r,_reg_d,_reg_a);
+      addLineOp(_dec_rr,_pair_bc,0);
+    }
+  }
+  addLine(_ret);
+  optimizeCode();
+  measureCode();
+  resetTimes();
+  for (long long k=0;k<=4;k++) { // boundary values
+    for (int j=-2;j<=2;j++) {
+      failed|=!testLong(n,bits,(k*n+j)&mask);
+      failed|=!testLong(n,bits,(mask-k*n+j)&mask);
+    }
+  }
+  for (int b=0;b<bits;b++) {
+    failed|=!testLong(n,bits,(1ULL<<b)&mask);
+    failed|=!testLong(n,bits,((1ULL<<b)-1)&mask);
+  }
+  for (int j=0;j<100000;j++) { // random values
+    seed=seed*6364136223846793005ULL+1442695040888963407ULL;
+    x=(seed>>(64-bits))&mask;
+    if (j&1) x=(x/n)*n-(j&3);  // near a multiple of n
+    failed|=!testLong(n,bits,x&mask);
+  }
+  if (failed) printf(";;---ERROR test fails---\n");
+  printf(";;\n;; %d-bit division by %lld\n",bits,n);
+  printf(";;\n;; Returns the integer quotient of dividing\n");
+  printf(";; the %d-bit number at (HL) by %lld\n",bits,n);
+  printf(";;\n;;   (HL) = (HL) / %lld\n;;\n",n);
+  printf(";;   Input: HL = address of the dividend (%d bytes, little endian)\n",bytes);
+  printf(";;  Output: quotient written over the dividend");
+  if (n<256) printf(", A = remainder");
+  printf("\n");
+  printDestroyed((n<256)?1<<_reg_a:0);
+  printf(";;\n");
+  printTimes();
+  printCredits();
+  printf("division_%d_by_%lld::\n",bits,n);
+  printlines();
+}
+
+// Add the code for HL = base * (pos - neg) (mod 65536), doubling HL and adding
+// or subtracting the base (kept in DE) from the highest digit. If start is
+// set the base is A, otherwise it's the value in HL, which is below maxBase.
+// Eight doublings in a row are made by moving L to H. Returns 0 if the
+// highest digit is negative.
+int addMultiplyDigits16(int pos,int neg,int start,long long maxBase) {
+  int digits=pos|neg;
+  int top=topDigit(digits);
+  int bit=top-1;
+  int many=countDigits(digits)>1;
+  int safe=1;  // no carry out of HL yet
+  int added=0;  // carry comes from an addition
+  int doubled=0;
+  long long prefix=1;
+  if ((neg>>top)&1) return 0;
+  if (start&&(top>=8)&&(((digits>>(top-7))&127)==0)) {
+    addLineOp(_ld_r_r,_reg_h,_reg_a);
+    addLineOp(_ld_r_n,_reg_l,0);
+    if (many) {
+      addLineOp(_ld_r_r,_reg_e,_reg_a);
+      addLineOp(_ld_r_n,_reg_d,0);
+    }
+    prefix=256;
+    bit-=7;
+    doubled=1;
+  }
+  else {
+    if (start) {
+      addLineOp(_ld_r_r,_reg_l,_reg_a);
+      addLineOp(_ld_r_n,_reg_h,0);
+    }
+    if (many) {
+      addLineOp(_ld_r_r,_reg_d,_reg_h);
+      addLineOp(_ld_r_r,_reg_e,_reg_l);
+    }
+  }
+  for (;bit>=0;bit--) {
+    if (doubled) doubled=0;  // already made by the start
+    else if ((bit>=7)&&(((digits>>(bit-6))&127)==0)) { // 8 doublings
+      addLineOp(_ld_r_r,_reg_h,_reg_l);
+      addLineOp(_ld_r_n,_reg_l,0);
+      prefix*=256;
+      bit-=7;
+    }
+    else {
+      addLineOp(_add_hl_rr,_pair_hl,0);
+      prefix*=2;
+      added=1;
+    }
+    if (prefix*maxBase>=65536) safe=0;
+    if ((pos>>bit)&1) {
+      addLineOp(_add_hl_rr,_pair_de,0);
+      prefix++;
+      added=1;
+      if (prefix*maxBase>=65536) safe=0;
+    }
+    if ((neg>>bit)&1) {
+      if (!(safe&&added)) addLineOp(_or_r,_reg_a,0);  // clear carry
+      addLineOp(_sbc_hl_rr,_pair_de,0);
+      prefix--;
+    }
+  }
+  return 1;
+}
+
+// Find the cheapest representation of n (mod 65536) for addMultiplyDigits16.
+// Returns the time*1000+size of the best one, or -1 if there is none.
+int bestMultiplyDigits16(long long n,int start,long long maxBase,int *bestPos,int *bestNeg) {
+  int first=numResultLines;
+  int best=-1;
+  int cost;
+  int size;
+  numReps=0;
+  findReps(n,0,16,0,0);
+  for (int i=0;i<numReps;i++) {
+    countCandidate(1);
+    numResultLines=first;
+    if (addMultiplyDigits16(repPos[i],repNeg[i],start,maxBase)==0) continue;
+    cost=measureFrom(first,&size)*1000+size;
+    if ((best<0)||(cost<best)) {
+      best=cost;
+      *bestPos=repPos[i];
+      *bestNeg=repNeg[i];
+    }
+  }
+  numResultLines=first;
+  return best;
+}
+
+// Add the code for HL = A * n (mod 65536). The options are a signed digit
+// chain in HL, the same for the low byte of n plus A * (n / 256) added to H,
+// or two chained multiplications by factors of n. The cheapest one is used.
+// Returns 1 if A is kept.
+int buildMultiply16(long long n) {
+  int first=numResultLines;
+  int pos=0;
+  int neg=0;
+  int pos2=0;
+  int neg2=0;
+  int best;
+  int cost;
+  int size;
+  int kind=0;
+  int bestFactor=0;
+  n&=0xFFFF;
+  if (n==0) {
+    addLineOp(_ld_rr_nn,_pair_hl,0);
+    return 1;
+  }
+  best=bestMultiplyDigits16(n,1,255,&pos,&neg);
+  if (n>=256) { // low byte in HL, high byte added to H
+    if ((n&255)==0) addLineOp(_ld_r_n,_reg_l,0);
+    else {
+      bestMultiplyDigits16(n&255,1,255,&pos2,&neg2);
+      addMultiplyDigits16(pos2,neg2,1,255);
+    }
+    buildMultiplyReg(n>>8,_reg_b,1);
+    if ((n&255)!=0) addLineOp(_add_r,_reg_h,0);
+    addLineOp(_ld_r_r,_reg_h,_reg_a);
+    cost=measureFrom(first,&size)*1000+size;
+    numResultLines=first;
+    if ((best<0)||(cost<best)) {
+      best=cost;
+      kind=1;
+    }
+  }
+  for (int f=3;f<=255;f++) { // two factors
+    if (((n%f)!=0)||(n/f<3)) continue;
+    cost=bestMultiplyDigits16(f,1,255,&pos2,&neg2);
+    if (cost<0) continue;
+    addMultiplyDigits16(pos2,neg2,1,255);
+    bestMultiplyDigits16(n/f,0,255*f,&pos2,&neg2);
+    addMultiplyDigits16(pos2,neg2,0,255*f);
+    cost=measureFrom(first,&size)*1000+size;
+    numResultLines=first;
+    if ((best<0)||(cost<best)) {
+      best=cost;
+      kind=2;
+      bestFactor=f;
+    }
+  }
+  if (kind==0) {
+    addMultiplyDigits16(pos,neg,1,255);
+    return 1;
+  }
+  if (kind==2) {
+    bestMultiplyDigits16(bestFactor,1,255,&pos,&neg);
+    addMultiplyDigits16(pos,neg,1,255);
+    bestMultiplyDigits16(n/bestFactor,0,255*bestFactor,&pos,&neg);
+    addMultiplyDigits16(pos,neg,0,255*bestFactor);
+    return 1;
+  }
+  if ((n&255)==0) addLineOp(_ld_r_n,_reg_l,0);
+  else {
+    bestMultiplyDigits16(n&255,1,255,&pos,&neg);
+    addMultiplyDigits16(pos,neg,1,255);
+  }
+  buildMultiplyReg(n>>8,_reg_b,1);
+  if ((n&255)!=0) addLineOp(_add_r,_reg_h,0);
+  addLineOp(_ld_r_r,_reg_h,_reg_a);
+  return 0;
+}
+
+// Creates a function that multiplies A by the integer n, with the 16 bits
+// product in HL or the low 8 bits in A
+void constantMultiply(long long n,int bits) {
+  int failed=-1;
+  int keepsA=0;
+  resetCode();
+  if (bits==8) buildMultiplyReg(n,_reg_b,1);
+  else keepsA=buildMultiply16(n);
+  addLine(_ret);
+  measureCode();
+  for (int j=0;(j<256)&&(failed<0);j++) { // test all inputs
+    z80Reg[_reg_a]=j;
+    z80Carry=j&1;  // the carry on entry must not matter
+    runCode();
+    if ((bits==8)&&(z80Reg[_reg_a]!=((j*n)&255))) failed=j;
+    if ((bits==16)&&(z80Reg[_reg_h]*256+z80Reg[_reg_l]!=((j*n)&0xFFFF))) failed=j;
+  }
+  if (failed>=0) printf(";;---ERROR test fails for input %d---\n",failed);
+  printf(";;\n;; Multiplication by %lld\n",n);
+  printf(";;\n;; Returns the %s of multiplying\n",bits==8?"low 8 bits":(n>257)?"low 16 bits":"result");
+  printf(";; the input value by %lld\n",n);
+  if (bits==8) printf(";;\n;;   A = A * %lld (mod 256)\n;;\n",n);
+  else printf(";;\n;;   HL = A * %lld%s\n;;\n",n,(n>257)?" (mod 65536)":"");
+  printf(";;   Input: A register\n");
+  printf(";;  Output: %s register\n",bits==8?"A":"HL");
+  printDestroyed((bits==8)?(1<<_reg_a):((1<<_reg_h)|(1<<_reg_l)|(keepsA<<_reg_a)));
+  printf(";;\n;; %d bytes / %d microseconds\n",sizeResult,speedResult);
+  printCredits();
+  printf("multiply%s_by_%lld::\n",bits==8?"8":"",n);
+  printlines();
+}
+
+// Returns the maximum error of A * m / 2^k (rounded to nearest if round is
+// set) against A * f for all inputs, leaving the mean error in *mean
+double scaleError(double f,int m,int k,int round,double *mean) {
+  double error;
+  double worst=0;
+  long long result;
+  *mean=0;
+  for (int j=0;j<256;j++) {
+    result=((long long)j*m+(round?(1<<k)/2:0))>>k;
+    if (result>255) return 1e9;
+    error=result-j*f;
+    if (error<0) error=-error;
+    if (error>worst) worst=error;
+    *mean+=error/256;
+  }
+  return worst;
+}
+
+// Add the code for A = A * m / 2^k, without 'ret'. If round is set, the bit
+// shifted out by the last shift is added to round to nearest. The last shift
+// is kept out of optimizeCode, which would lose that bit.
+// Returns the number of powers of two used, or 0 if it can't be rounded.
+int buildScale(int m,int k,int round) {
+  int numpowers=1;
+  if (m==0) {
+    addLine(_xor_a);
+    return round?0:1;
+  }
+  numpowers=buildChain(m,k);
+  if (!round) return numpowers;
+  if ((numResultLines==0)||(k==0)) return 0;
+  if (resultLines[numResultLines-1]==_srl_a) {
+    resultLines[numResultLines-1]=_srl_r;
+    resultOp1[numResultLines-1]=_reg_a;
+  }
+  else if (resultLines[numResultLines-1]!=_rra) return 0;
+  addLineOp(_adc_n,0,0);
+  return numpowers;
+}
+
+// Creates a function that multiplies A by the real factor f (0..1) with an
+// error strictly below maxError for every input. Every fraction m/2^k (k up
+// to 16) close enough to f is tried, truncated or rounded to nearest, and
+// the fastest chain is kept.
+void scaleFactor(double f,double maxError) {
+  char text[32];
+  int bestSpeed=-1;
+  int bestSize=0;
+  int bestM=0;
+  int bestK=0;
+  int bestRound=0;
+  int first;
+  int last;
+  int numpowers;
+  int exact;
+  int state;
+  double worst;
+  double mean;
+  double bestWorst=0;
+  phaseBegin(_phase_search);
+  for (int k=0;k<=16;k++) {
+    first=(f-maxError/255)*(1<<k)-1;
+    last=(f+maxError/255)*(1<<k)+1;
+    if (first<0) first=0;
+    if (last>(1<<k)) last=1<<k;
+    for (int m=first;m<=last;m++) {
+      if (((m&1)==0)&&(m!=0)&&(k>0)) continue;  // same as m/2 over 2^(k-1)
+      for (int round=0;round<2;round++) {
+        worst=scaleError(f,m,k,round,&mean);
+        countCandidate(worst<maxError);
+        if (worst>=maxError) continue;
+        resetCode();
+        if (!buildScale(m,k,round)) continue;
+        addLine(_ret);
+        optimizeCode();
+        exact=1;
+        state=runPrefixStates();
+        for (int j=0;(j<256)&&exact;j++) { // buildChain drops too small powers
+          if (stateA[state][j]!=(((long long)j*m+(round?(1<<k)/2:0))>>k)) exact=0;
+        }
+        if (!exact) continue;
+        measureCode();
+        if ((bestSpeed<0)||(speedResult<bestSpeed)||((speedResult==bestSpeed)&&(sizeResult<bestSize))
+            ||((speedResult==bestSpeed)&&(sizeResult==bestSize)&&(worst<bestWorst))) {
+          bestSpeed=speedResult;
+          bestSize=sizeResult;
+          bestWorst=worst;
+          bestM=m;
+          bestK=k;
+          bestRound=round;
+        }
+      }
+    }
+  }
+  phaseEnd(_phase_search);
+  if (bestSpeed<0) {
+    printf("No approximation found with an error strictly below %g.\n",maxError);
+    return;
+  }
+  resetCode();
+  numpowers=buildScale(bestM,bestK,bestRound);
+  addLine(_ret);
+  fractionRound=bestRound;
+  finishCode(bestM,1<<bestK);
+  fractionRound=0;
+  worst=scaleError(f,bestM,bestK,bestRound,&mean);
+  sprintf(text,"%.6f",f);  // plain decimal, valid in a label
+  while (text[strlen(text)-1]=='0') text[strlen(text)-1]=0;
+  if (text[strlen(text)-1]=='.') text[strlen(text)-1]=0;
+  printf(";;\n;; Multiplication by %s\n",text);
+  printf(";;\n;; Returns the input value multiplied by %s,\n",text);
+  printf(";; approximated by the fraction %d/%d%s\n",bestM,1<<bestK,bestRound?" (rounded)":"");
+  printf(";;\n;;   A = A * %s\n;;\n",text);
+  printf(";;  Max error: %.3f (must be below %g)\n",(int)(worst*1000)/1000.0,maxError);  // rounded down
+  printf(";; Mean error: %.3f\n;;\n",mean);
+  printRegisters(numpowers>1?_destroys_b:_only_use_a);
+  printf(";;\n;; %d bytes / %d microseconds\n",sizeResult,speedResult);
+  printCredits();
+  printf("scale_%s",text);
+  printIndexSuffix();
+  printf("::\n");
+  printlines();
+}
+
+// Creates a function that divides A by the value in B, for A from 0 to maxA
+// and B from minB to maxB, returning the quotient in A (and the remainder in
+// B if mod is set). It is an unrolled restoring division with the quotient
+// bits inverted in C. Only the quotient bits that can be 1 are calculated,
+// the dividend bits above them go to the remainder at once rotating A.
+void variableDivision(int maxA,int minB,int maxB,int mod) {
+  int bits=0;
+  int label;
+  int failed=-1;
+  while ((bits<8)&&(((maxA/minB)>>bits)!=0)) bits++;  // bits of the quotient
+  resetCode();
+  if (bits==0) { // quotient is always 0
+    if (mod) addLine(_ld_ba);
+    addLine(_xor_a);
+  }
+  else {
+    if (bits<=4) for (int i=0;i<bits;i++) addLine(_rrca);  // low bits of A to the top
+    else for (int i=bits;i<8;i++) addLine(_rlca);
+    addLineOp(_ld_r_r,_reg_c,_reg_a);
+    if (bits==8) addLine(_xor_a);
+    else addLineOp(_and_n,(1<<(8-bits))-1,0);  // remainder = A >> bits
+    for (int i=0;i<bits;i++) {
+      label=newLabel(NULL);
+      addLineOp(_rl_r,_reg_c,0);  // next dividend bit out, previous quotient bit in
+      addLine(_rla);
+      addLineOp(_cp_r,_reg_b,0);
+      addLineOp(_jr_c,label,0);
+      addLineOp(_sub_r,_reg_b,0);
+      addLineOp(_label,label,0);
+    }
+    if (mod) addLine(_ld_ba);
+    addLineOp(_rl_r,_reg_c,0);
+    addLineOp(_ld_r_r,_reg_a,_reg_c);
+    addLine(_cpl);
+    if (bits<8) addLineOp(_and_n,(1<<bits)-1,0);
+  }
+  addLine(_ret);
+  measureCode();
+  resetTimes();
+  for (int a=0;(a<=maxA)&&(failed<0);a++) { // test all pairs in range
+    for (int b=minB;(b<=maxB)&&(failed<0);b++) {
+      z80Reg[_reg_a]=a;
+      z80Reg[_reg_b]=b;
+      z80Reg[_reg_c]=a*7+b;
+      z80Carry=(a+b)&1;
+      addTime(runCode());
+      if ((z80Reg[_reg_a]!=a/b)||(mod&&(z80Reg[_reg_b]!=a%b))) failed=a*256+b;
+    }
+  }
+  if (failed>=0) printf(";;---ERROR test fails for A=%d B=%d---\n",failed>>8,failed&255);
+  printf(";;\n;; Variable division\n");
+  printf(";;\n;; Returns the quotient%s of dividing A by B\n",mod?" and the remainder":"");
+  printf(";; for A from 0 to %d and B from %d to %d\n",maxA,minB,maxB);
+  printf(";;\n;;   A = A / B\n");
+  if (mod) printf(";;   B = A mod B\n");
+  printf(";;\n;;   Input: A register (dividend), B register (divisor)\n");
+  if (mod) printf(";;  Output: A register (quotient), B register (remainder)\n");
+  else printf(";;  Output: A register (quotient)\n");
+  printDestroyed((1<<_reg_a)|(mod<<_reg_b));
+  printf(";;\n");
+  printTimes();
+  printCredits();
+  printf("divide_a_by_b_%d_%d_%d%s::\n",maxA,minB,maxB,mod?"_mod":"");
+  printlines();
+}
+
+// Adds the code for k / A, for A from 1 to maxA, as an unrolled restoring
+// division. The bits of the constant dividend are known, so they are put in
+// the remainder (A) with 'inc a', and the overflow of the remainder is only
+// checked when A can be above 128. The quotient bits are collected inverted
+// in C (or H and L if k doesn't fit in 8 bits).
+void addConstantDivision(long long k,int maxA) {
+  int bits=0;
+  int bit;
+  int label;
+  int overflow;
+  int reg;
+  long long partial;
+  long long remainder=0;  // maximum value of the remainder
+  while ((k>>bits)!=0) bits++;
+  addLine(_ld_ba);
+  for (int i=bits-1;i>=0;i--) {
+    bit=(k>>i)&1;
+    partial=k>>i;
+    reg=(k<256)?_reg_c:((i>=8)?_reg_h:_reg_l);
+    if (i==bits-1) addLineOp(_ld_r_n,_reg_a,1);
+    else {
+      addLineOp(_add_r,_reg_a,0);
+      if (bit) addLineOp(_inc_r,_reg_a,0);
+    }
+    overflow=(remainder*2+bit>255)&&(partial>255);
+    label=newLabel(NULL);
+    if (overflow) { // the remainder doesn't fit in A: subtract and clear carry
+      int noOverflow=newLabel(NULL);
+      addLineOp(_jr_nc,noOverflow,0);
+      addLineOp(_sub_r,_reg_b,0);
+      addLineOp(_or_r,_reg_a,0);
+      addLineOp(_jr_nc,label,0);  // always taken
+      addLineOp(_label,noOverflow,0);
+    }
+    addLineOp(_cp_r,_reg_b,0);
+    addLineOp(_jr_c,label,0);
+    addLineOp(_sub_r,_reg_b,0);
+    addLineOp(_label,label,0);
+    addLineOp(_rl_r,reg,0);
+    remainder=(partial<maxA-1)?partial:maxA-1;
+  }
+  if (k<256) {
+    addLineOp(_ld_r_r,_reg_a,_reg_c);
+    addLine(_cpl);
+    if (bits<8) addLineOp(_and_n,(1<<bits)-1,0);
+  }
+  else {
+    addLineOp(_ld_r_r,_reg_a,_reg_h);
+    addLine(_cpl);
+    if (bits<16) addLineOp(_and_n,(1<<(bits-8))-1,0);
+    addLineOp(_ld_r_r,_reg_h,_reg_a);
+    addLineOp(_ld_r_r,_reg_a,_reg_l);
+    addLine(_cpl);
+    addLineOp(_ld_r_r,_reg_l,_reg_a);
+  }
+  addLine(_ret);
+}
+
+// Finds the compare trees with the lowest worst time and total time (in
+// the order given by treeByTotal) for the intervals from first to each of
+// the following ones.
+// A node is 'cp #n' and 'jr c' or 'jr nc', so the side reached by the jump
+// costs 1 microsecond more. Trees starting after first must be known.
+void findTree(int first) {
+  int worst;
+  long long total;
+  int costLeft;
+  int costRight;
+  long long inputs[257];  // inputs before each interval
+  inputs[first]=0;
+  for (int i=first;i<treeNumIntervals;i++) inputs[i+1]=inputs[i]+treeCount[i];
+  for (int last=first+1;last<treeNumIntervals;last++) {
+    treeWorst[first][last]=-1;
+    for (int split=first+1;split<=last;split++) {
+      for (int jump=0;jump<2;jump++) { // jump=0: 'jr c' to the left side
+        costLeft=jump?4:5;
+        costRight=jump?5:4;
+        worst=treeWorst[first][split-1]+costLeft;
+        if (treeWorst[split][last]+costRight>worst) worst=treeWorst[split][last]+costRight;
+        total=treeTotal[first][split-1]+treeTotal[split][last]
+              +(inputs[split]-inputs[first])*costLeft+(inputs[last+1]-inputs[split])*costRight;
+        if ((treeWorst[first][last]<0)
+            ||(!treeByTotal&&((worst<treeWorst[first][last])||((worst==treeWorst[first][last])&&(total<treeTotal[first][last]))))
+            ||(treeByTotal&&((total<treeTotal[first][last])||((total==treeTotal[first][last])&&(worst<treeWorst[first][last]))))) {
+          treeWorst[first][last]=worst;
+          treeTotal[first][last]=total;
+          treeSplit[first][last]=split*2+jump;
+        }
+      }
+    }
+  }
+}
+
+// Adds the code of piece i of a split division
+void addPiece(int i) {
+  switch(pieceKind[i]) {
+    case _piece_constant:
+      if (treeResult[i]==0) addLine(_xor_a);
+      else addLineOp(_ld_r_n,_reg_a,treeResult[i]);
+      break;
+    case _piece_step:
+      addLineOp(_cp_n,pieceStep[i],0);
+      addLineOp(_sbc_r,_reg_a,0);
+      if (treeResult[i]==1) addLineOp(_inc_r,_reg_a,0);
+      else addLineOp(_add_n,treeResult[i],0);
+      break;
+    default:
+      buildChain(pieceM[i],pieceK[i]);
+      if (pieceAdd[i]==1) addLineOp(_inc_r,_reg_a,0);
+      else if (pieceAdd[i]==-1) addLineOp(_dec_r,_reg_a,0);
+      else if (pieceAdd[i]!=0) addLineOp(_add_n,pieceAdd[i]&255,0);
+  }
+  addLine(_ret);
+}
+
+// Adds the code of the compare tree for intervals first to last (k is the
+// dividend of an inverse division)
+void addTree(int first,int last,long long k) {
+  int split;
+  int label;
+  if (first==last) {
+    if (treeKind==_tree_pieces) addPiece(first);
+    else if ((treeDivision>0)&&(first==treeDivision-1)) addConstantDivision(k,treeStart[treeDivision]-1);
+    else {
+      if (k>255) addLineOp(_ld_rr_nn,_pair_hl,treeResult[first]);
+      else if (treeResult[first]==0) addLine(_xor_a);
+      else addLineOp(_ld_r_n,_reg_a,treeResult[first]);
+      addLine(_ret);
+    }
+    return;
+  }
+  split=treeSplit[first][last]>>1;
+  label=newLabel(NULL);
+  addLineOp(_cp_n,treeStart[split],0);
+  if (treeSplit[first][last]&1) {
+    addLineOp(_jr_nc,label,0);
+    addTree(first,split-1,k);
+    addLineOp(_label,label,0);
+    addTree(split,last,k);
+  }
+  else {
+    addLineOp(_jr_c,label,0);
+    addTree(split,last,k);
+    addLineOp(_label,label,0);
+    addTree(first,split-1,k);
+  }
+}
+
+// Finds the intervals of inputs with the same result of k / A, and the
+// compare trees using only them
+void findIntervals(long long k) {
+  treeNumIntervals=0;
+  for (int a=1;a<256;a++) {
+    if ((a==1)||(k/a!=treeResult[treeNumIntervals-1])) {
+      treeStart[treeNumIntervals]=a;
+      treeResult[treeNumIntervals]=k/a;
+      treeCount[treeNumIntervals]=0;
+      treeWorst[treeNumIntervals][treeNumIntervals]=(k>255)?6:((k/a==0)?4:5);  // ld and ret
+      treeNumIntervals++;
+    }
+    treeCount[treeNumIntervals-1]++;
+    treeTotal[treeNumIntervals-1][treeNumIntervals-1]=treeCount[treeNumIntervals-1]*treeWorst[treeNumIntervals-1][treeNumIntervals-1];
+  }
+  treeStart[treeNumIntervals]=256;
+  for (int first=treeNumIntervals-1;first>=0;first--) findTree(first);
+}
+
+// Builds the routine for k / A using the unrolled division for the inputs
+// below interval division (none if 0) and a compare tree for the rest.
+// Intervals must be searched from the lowest division. Returns the first
+// input with a wrong result, or -1 if the routine is correct, leaving its
+// times in the timing statistics. No code is left if it needs too many labels.
+int buildInverse(long long k,int division) {
+  int result;
+  int failed=-1;
+  int labels;
+  int bits=0;
+  int first=0;
+  while ((k>>bits)!=0) bits++;
+  treeDivision=division;
+  if (division>0) {
+    first=division-1;
+    resetCode();
+    addConstantDivision(k,treeStart[division]-1);
+    resetTimes();
+    for (int a=1;a<treeStart[division];a++) {
+      z80Reg[_reg_a]=a;
+      addTime(runCode());
+    }
+    treeCount[first]=treeStart[division]-1;
+    treeWorst[first][first]=timeWorst;
+    treeTotal[first][first]=timeTotal;
+    findTree(first);
+  }
+  labels=treeNumIntervals-1-first+((division>0)?bits*2:0);
+  resetCode();
+  if (labels>=MAXLABELS) return 0;
+  addTree(first,treeNumIntervals-1,k);
+  measureCode();
+  resetTimes();
+  for (int a=1;a<256;a++) { // test all inputs
+    z80Reg[_reg_a]=a;
+    z80Reg[_reg_b]=a*13;
+    z80Reg[_reg_c]=a*7;
+    z80Reg[_reg_h]=a*5;
+    z80Reg[_reg_l]=a*3;
+    z80Carry=a&1;
+    addTime(runCode());
+    result=(k>255)?z80Reg[_reg_h]*256+z80Reg[_reg_l]:z80Reg[_reg_a];
+    if ((result!=k/a)&&(failed<0)) failed=a;
+  }
+  return failed;
+}
+
+// Creates a function that divides the constant k by A (1 to 255), returning
+// the quotient in A (or HL if k doesn't fit in 8 bits). Small inputs use an
+// unrolled division and big inputs, which have few different results, a
+// compare tree. The limit between both is chosen for the lowest worst time
+// (then average time and size), with a size up to maxSize bytes.
+void inverseDivision(long long k,int maxSize) {
+  int best=-1;
+  int bestWorst=0;
+  int bestTotal=0;
+  int bestSize=0;
+  int failed;
+  phaseBegin(_phase_search);
+  findIntervals(k);
+  for (int division=0;division<=treeNumIntervals;division++) {
+    failed=buildInverse(k,division);
+    countCandidate((failed<0)&&(numResultLines>0)&&((maxSize==0)||(sizeResult<=maxSize)));
+    if ((failed>=0)||(numResultLines==0)||((maxSize>0)&&(sizeResult>maxSize))) continue;
+    if ((best<0)||(timeWorst<bestWorst)||((timeWorst==bestWorst)&&(timeTotal<bestTotal))
+        ||((timeWorst==bestWorst)&&(timeTotal==bestTotal)&&(sizeResult<bestSize))) {
+      best=division;
+      bestWorst=timeWorst;
+      bestTotal=timeTotal;
+      bestSize=sizeResult;
+    }
+  }
+  phaseEnd(_phase_search);
+  if (best<0) {
+    printf("No routine found up to %d bytes.\n",maxSize);
+    return;
+  }
+  findIntervals(k);
+  failed=buildInverse(k,best);
+  if (failed>=0) printf(";;---ERROR test fails for input %d---\n",failed);
+  printf(";;\n;; Division of %lld by A\n",k);
+  printf(";;\n;; Returns the integer quotient of dividing %lld\n",k);
+  printf(";; by the input value (from 1 to 255), using\n");
+  if (best==0) printf(";; a compare tree\n");
+  else if (best==treeNumIntervals) printf(";; an unrolled division\n");
+  else printf(";; an unrolled division up to %d and a compare tree above\n",treeStart[best]-1);
+  printf(";;\n;;   %s = %lld / A\n",(k>255)?"HL":"A",k);
+  printf(";;\n;;   Input: A register\n");
+  printf(";;  Output: %s\n",(k>255)?"HL registers":"A register");
+  printDestroyed((k>255)?(1<<_reg_h)|(1<<_reg_l):1<<_reg_a);
+  printf(";;\n");
+  printTimes();
+  printCredits();
+  printf("inverse_%lld::\n",k);
+  printlines();
+}
+
+// Sets the pieces of a split division for inputs from start[i] (start[0]=0),
+// each one computed with its cheapest code in pieceChoice: the constant
+// (-1), the step (-2), or a chain of the table. Returns the worst time of
+// the tree, leaving its total time in *total.
+int setPieces(int numPieces,int *start,int pieceChoice[256][256],int pieceTime[256][256],
+              int *chainM,int *chainK,unsigned char chainResult[][256],unsigned char *quotient,long long *weights,long long *total) {
+  int first;
+  int last;
+  int choice;
+  treeNumIntervals=numPieces;
+  for (int i=0;i<numPieces;i++) {
+    first=start[i];
+    last=(i<numPieces-1)?start[i+1]-1:255;
+    choice=pieceChoice[first][last];
+    treeStart[i]=first;
+    treeResult[i]=quotient[last];
+    treeCount[i]=0;
+    for (int j=first;j<=last;j++) treeCount[i]+=weights[j];
+    treeWorst[i][i]=pieceTime[first][last];
+    treeTotal[i][i]=treeCount[i]*treeWorst[i][i];
+    if (choice==-1) pieceKind[i]=_piece_constant;
+    else if (choice==-2) {
+      pieceKind[i]=_piece_step;
+      for (pieceStep[i]=first;quotient[pieceStep[i]]!=quotient[last];pieceStep[i]++);
+    }
+    else {
+      pieceKind[i]=_piece_chain;
+      pieceM[i]=chainM[choice];
+      pieceK[i]=chainK[choice];
+      pieceAdd[i]=quotient[first]-chainResult[choice][first];
+    }
+  }
+  for (int i=numPieces-1;i>=0;i--) findTree(i);
+  *total=treeTotal[0][numPieces-1];
+  return treeWorst[0][numPieces-1];
+}
+
+// Creates a division function by num which splits the inputs in up to three
+// pieces with 'cp' and conditional jumps. Each piece gets its cheapest code,
+// which only has to be exact over the piece: a chain from buildChain (plus
+// a constant), a single step (cp, sbc, add) or a constant. The split points
+// are chosen for the lowest worst time, or for the lowest average time
+// with the given weight for each input if average is set (a profile if
+// profile is set, or 1 for all inputs).
+void splitDivision(float num,int average,long long *weights,int profile) {
+  static int pieceTime[256][256];
+  static int pieceChoice[256][256];
+  static unsigned char chainResult[17*8][256];
+  unsigned char quotient[256];
+  int chainM[17*8];
+  int chainK[17*8];
+  int chainTime[17*8];
+  int numChains=0;
+  int state;
+  int runEnd[256];
+  int time;
+  int worst;
+  int bestWorst=-1;
+  int singleWorst=0;
+  long long total;
+  long long bestTotal=0;
+  int start[MAXPIECES];
+  int bestStart[MAXPIECES];
+  int bestPieces=0;
+  int numPieces;
+  long long num2;
+  long long den;
+  long long first;
+  int registers;
+  int written[NUMREGISTERS];
+  phaseBegin(_phase_search);
+  exactDivisor(num,&num2,&den);
+  for (int j=0;j<256;j++) quotient[j]=exactQuotient(num,j);
+  for (int k=0;k<=16;k++) { // chains near 1/num, correct for some inputs
+    first=(((long long)1<<k)*den)/num2;
+    for (long long m=first-3;m<=first+4;m++) {
+      if ((m<1)||(m>(1<<k))) continue;
+      resetCode();
+      buildChain(m,k);
+      addLine(_ret);
+      optimizeCode();
+      measureCode();
+      chainM[numChains]=m;
+      chainK[numChains]=k;
+      chainTime[numChains]=speedResult;
+      state=runPrefixStates();
+      for (int j=0;j<256;j++) chainResult[numChains][j]=stateA[state][j];
+      numChains++;
+    }
+  }
+  for (int low=0;low<256;low++) { // cheapest code for inputs from low to high
+    for (int high=low;high<256;high++) {
+      pieceTime[low][high]=-1;
+      if (quotient[high]==quotient[low]) {
+        pieceChoice[low][high]=-1;
+        pieceTime[low][high]=(quotient[low]==0)?4:5;
+      }
+      else if (quotient[high]==quotient[low]+1) {
+        pieceChoice[low][high]=-2;
+        pieceTime[low][high]=(quotient[high]==1)?7:8;
+      }
+    }
+  }
+  for (int c=0;c<numChains;c++) {
+    runEnd[255]=255;
+    for (int j=254;j>=0;j--) {
+      if ((unsigned char)(chainResult[c][j]-quotient[j])==(unsigned char)(chainResult[c][j+1]-quotient[j+1])) runEnd[j]=runEnd[j+1];
+      else runEnd[j]=j;
+    }
+    for (int low=0;low<256;low++) {
+      int add=quotient[low]-chainResult[c][low];
+      time=chainTime[c]+((add==0)?0:(((add==1)||(add==-1))?1:2));
+      for (int high=low;high<=runEnd[low];high++) {
+        countCandidate(1);
+        if ((pieceTime[low][high]<0)||(time<pieceTime[low][high])) {
+          pieceTime[low][high]=time;
+          pieceChoice[low][high]=c;
+        }
+      }
+    }
+  }
+  start[0]=0;
+  for (start[1]=1;start[1]<=256;start[1]++) { // try all split points (256 for none)
+    for (start[2]=start[1]+1;start[2]<=257;start[2]++) {
+      if ((start[1]==256)&&(start[2]!=257)) continue;
+      numPieces=1+(start[1]<256)+(start[2]<256);
+      worst=setPieces(numPieces,start,pieceChoice,pieceTime,chainM,chainK,chainResult,quotient,weights,&total);
+      if (numPieces==1) singleWorst=worst;
+      if ((bestWorst<0)||(!average&&((worst<bestWorst)||((worst==bestWorst)&&(total<bestTotal))))
+          ||(average&&((total<bestTotal)||((total==bestTotal)&&(worst<bestWorst))))
+          ||((worst==bestWorst)&&(total==bestTotal)&&(numPieces<bestPieces))) {
+        bestWorst=worst;
+        bestTotal=total;
+        bestPieces=numPieces;
+        for (int i=0;i<numPieces;i++) bestStart[i]=start[i];
+      }
+    }
+  }
+  phaseEnd(_phase_search);
+  phaseBegin(_phase_generate);
+  setPieces(bestPieces,bestStart,pieceChoice,pieceTime,chainM,chainK,chainResult,quotient,weights,&total);
+  resetCode();
+  treeKind=_tree_pieces;
+  addTree(0,bestPieces-1,0);
+  treeKind=_tree_inverse;
+  findWritten(written);
+  registers=written[_reg_b]?_destroys_b:_only_use_a;
+  if (profile) timeWeights=weights;
+  finishCode(num,0);
+  printDivisionBy(num);
+  if (bestPieces==1) printf(";; Inputs are not split\n");
+  else if (bestPieces==2) printf(";; Inputs split at %d\n",bestStart[1]);
+  else printf(";; Inputs split at %d and %d\n",bestStart[1],bestStart[2]);
+  printf(";; (%d microseconds without splitting)\n;;\n",singleWorst);
+  printRegisters(registers);
+  printf(";;\n");
+  printTimes();
+  timeWeights=NULL;
+  printCredits();
+  printf("division_by_%g_split",num);
+  printIndexSuffix();
+  printf("::\n");
+  printlines();
+  phaseEnd(_phase_generate);
+}
+
+// Finds the chains of the levels placed in the jump table (those of
+// tableSize bytes, and the last one) and the chains entered in the middle
+// of a longer one, from the longest chain to the shortest.
+void shareLevels(int tableSize) {
+  int l;
+  int same;
+  for (l=0;l<numLevels;l++) {
+    levelInline[l]=(levelSize[l]==tableSize)||(l==numLevels-1);
+    levelOwner[l]=-1;
+  }
+  while (1) {
+    l=-1;
+    for (int m=0;m<numLevels;m++) { // longest chain not placed yet
+      if (!levelInline[m]&&(levelOwner[m]<0)&&((l<0)||(levelLength[m]>levelLength[l]))) l=m;
+    }
+    if (l<0) return;
+    levelOwner[l]=l;
+    levelOffset[l]=0;
+    for (int m=0;(m<numLevels)&&(levelOwner[l]==l);m++) {
+      if (levelInline[m]||(levelOwner[m]!=m)||(m==l)||(levelLength[m]<levelLength[l])) continue;
+      same=1;
+      for (int i=1;(i<=levelLength[l])&&same;i++) {
+        same=(levelLines[l][levelLength[l]-i]==levelLines[m][levelLength[m]-i])
+           &&(levelOp1[l][levelLength[l]-i]==levelOp1[m][levelLength[m]-i])
+           &&(levelOp2[l][levelLength[l]-i]==levelOp2[m][levelLength[m]-i]);
+      }
+      if (same) {
+        levelOwner[l]=m;
+        levelOffset[l]=levelLength[m]-levelLength[l];
+      }
+    }
+  }
+}
+
+// Adds the chain of a level, with a label at the entry of each chain that
+// ends inside it. If labelsOnly is set, only creates those labels.
+void addLevelChain(int owner,int labelsOnly) {
+  for (int i=0;i<levelLength[owner];i++) {
+    for (int l=0;l<numLevels;l++) {
+      if (levelInline[l]||(levelOwner[l]!=owner)||(levelOffset[l]!=i)) continue;
+      if (labelsOnly) levelLabel[l]=newLabel(NULL);
+      else addLineOp(_label,levelLabel[l],0);
+    }
+    if (!labelsOnly) addLineOp(levelLines[owner][i],levelOp1[owner][i],levelOp2[owner][i]);
+  }
+}
+
+// Builds the function of a fraction by a runtime level, which jumps to the
+// chain of the level through a table of 'jr' (or 'jp' if jp is set). The
+// chains of the levels below split go between 'jp (hl)' and the table, so
+// more of them are in range of a 'jr', and the rest go after the table.
+// Returns 0 if a 'jr' is out of range.
+int buildLevels(int jp,int split) {
+  int table;
+  int here=z80Code;
+  int address[MAXLINES];
+  resetCode();
+  shareLevels(jp?3:2);
+  for (int l=0;l<split;l++) {
+    if (!levelInline[l]&&(levelOwner[l]==l)) addLevelChain(l,1);
+  }
+  table=newLabel(NULL);
+  for (int l=split;l<numLevels;l++) {
+    if (!levelInline[l]&&(levelOwner[l]==l)) addLevelChain(l,1);
+  }
+  addLineOp(_ld_r_n,_reg_b,0);  // HL = table + C * entry size
+  addLineOp(_ld_rr_label,_pair_hl,table);
+  for (int i=0;i<(jp?3:2);i++) addLineOp(_add_hl_rr,_pair_bc,0);
+  addLine(_jp_hl);
+  for (int l=0;l<split;l++) {
+    if (!levelInline[l]&&(levelOwner[l]==l)) addLevelChain(l,0);
+  }
+  addLineOp(_label,table,0);
+  for (int l=0;l<numLevels;l++) {
+    if (levelInline[l]) {
+      for (int i=0;i<levelLength[l];i++) addLineOp(levelLines[l][i],levelOp1[l][i],levelOp2[l][i]);
+    }
+    else addLineOp(jp?_jp:_jr,levelLabel[l],0);
+  }
+  for (int l=split;l<numLevels;l++) {
+    if (!levelInline[l]&&(levelOwner[l]==l)) addLevelChain(l,0);
+  }
+  for (int i=0;i<numResultLines;i++) {
+    address[i]=here;
+    here+=lineSize(i);
+  }
+  for (int i=0;i<numResultLines;i++) {
+    if ((resultLines[i]==_jr)&&((address[findLabel(resultOp1[i])]-address[i]-2<-128)||(address[findLabel(resultOp1[i])]-address[i]-2>127))) return 0;
+  }
+  return 1;
+}
+
+// Creates a function that multiplies A by C/2^k, for any level C from 0 to
+// 2^k known only at runtime (truncated, or rounded to nearest if round is
+// set). Each level has its own chain from buildScale, as the routine of the
+// fraction would, and the function jumps to it through a table indexed by C.
+void levelFraction(int k,int round) {
+  int i;
+  int found=0;
+  int failed=-1;
+  int jumpTime=0;
+  int slowest=0;
+  int expected;
+  phaseBegin(_phase_generate);
+  numLevels=(1<<k)+1;
+  for (int l=0;l<numLevels;l++) {
+    resetCode();
+    if (l==0) addLine(_xor_a);
+    else if (l<numLevels-1) buildScale(l,k,round);
+    addLine(_ret);
+    optimizeCode();
+    measureCode();
+    for (int i=0;i<numResultLines;i++) {
+      levelLines[l][i]=resultLines[i];
+      levelOp1[l][i]=resultOp1[i];
+      levelOp2[l][i]=resultOp2[i];
+    }
+    levelLength[l]=numResultLines;
+    levelSize[l]=sizeResult;
+    levelTime[l]=speedResult;
+    if (speedResult>slowest) slowest=speedResult;
+  }
+  for (int jp=0;(jp<2)&&!found;jp++) { // a table of 'jr' if they reach their chains
+    for (int split=0;(split<=numLevels)&&!found;split++) {
+      found=buildLevels(jp,split);
+      countCandidate(found);
+    }
+  }
+  for (i=0;resultLines[i]!=_jp_hl;i++) jumpTime+=lineTime(i);
+  jumpTime+=lineTime(i)+3;  // and the 'jr' or 'jp' of the table
+  measureCode();
+  phaseEnd(_phase_generate);
+  phaseBegin(_phase_test);
+  resetTimes();
+  for (int l=0;(l<numLevels)&&(failed<0);l++) { // test all levels and inputs
+    for (int j=0;(j<256)&&(failed<0);j++) {
+      z80Reg[_reg_a]=j;
+      z80Reg[_reg_b]=j*7+l;
+      z80Reg[_reg_c]=l;
+      z80Reg[_reg_d]=j^l;
+      z80Reg[_reg_e]=j*3;
+      z80Reg[_reg_h]=l*5;
+      z80Reg[_reg_l]=j+l;
+      z80Carry=(j+l)&1;
+      addTime(runCode());
+      expected=(j*l+(round?(1<<k)/2:0))>>k;
+      if ((z80Reg[_reg_a]!=expected)||(z80Reg[_reg_c]!=l)) failed=l*256+j;
+    }
+  }
+  phaseEnd(_phase_test);
+  if (failed>=0) printf(";;---ERROR test fails for A=%d C=%d---\n",failed&255,failed>>8);
+  printf(";;\n;; Multiplication by a level\n");
+  printf(";;\n;; Returns the integer part of multiplying\n");
+  printf(";; the input value by the fraction C/%d, for\n",1<<k);
+  printf(";; any level C from 0 to %d%s\n",1<<k,round?" (rounded to nearest)":"");
+  printf(";;\n;;   A = A * ( C / %d )\n",1<<k);
+  printf(";;\n;;   Input: A register (value), C register (level)\n");
+  printf(";;  Output: A register\n");
+  printDestroyed(1<<_reg_a);
+  printf(";;\n;; Jump to the chain of the level: %d microseconds\n",jumpTime);
+  printf(";; (slowest chain alone: %d microseconds)\n;;\n",slowest);
+  printTimes();
+  printCredits();
+  printf("fraction_level_%d%s::\n",1<<k,round?"_round":"");
+  printlines();
+}
+
+// Reads an assembly source into sourceText[] and splits each line into label,
+// instruction and operands. Returns 0 if it can't be read.
+int readSource(char *name) {
+  FILE *file;
+  char text[256];
+  char *p;
+  char *end;
+  int depth;
+  int second;
+  int n;
+  file=fopen(name,"r");
+  if (file==NULL) return 0;
+  numSource=0;
+  while ((numSource<MAXSOURCE)&&(fgets(sourceText[numSource],256,file)!=NULL)) {
+    n=strlen(sourceText[numSource]);
+    if ((n==255)&&(sourceText[numSource][254]!='\n')) { // line too long to be written back
+      fclose(file);
+      return 0;
+    }
+    strcpy(text,sourceText[numSource]);
+    if ((p=strchr(text,';'))!=NULL) *p=0;
+    sourceLabel[numSource][0]=0;
+    sourceOp[numSource][0]=0;
+    sourceArg1[numSource][0]=0;
+    sourceArg2[numSource][0]=0;
+    sourceKind[numSource]=_source_empty;
+    for (p=text;(*p==' ')||(*p=='\t');p++);
+    for (end=p;(*end=='_')||(*end=='.')||(*end=='$')||((*end>='0')&&(*end<='9'))||(((*end|32)>='a')&&((*end|32)<='z'));end++);
+    if ((end>p)&&(*end==':')) { // label
+      while (*end==':') end++;
+      n=end-p;
+      if (n>63) n=63;
+      memcpy(sourceLabel[numSource],p,n);
+      sourceLabel[numSource][n]=0;
+      for (p=end;(*p==' ')||(*p=='\t');p++);
+    }
+    for (n=0;(n<15)&&((((*p|32)>='a')&&((*p|32)<='z'))||(*p=='.'));p++) sourceOp[numSource][n++]=*p|32;
+    sourceOp[numSource][n]=0;
+    if (n>0) sourceKind[numSource]=_source_code;
+    if ((sourceOp[numSource][0]=='.')||(strchr(p,'=')!=NULL)) sourceKind[numSource]=_source_other;
+    else if ((n==0)&&(*p>' ')) sourceKind[numSource]=_source_other;
+    depth=0;
+    second=0;
+    end=sourceArg1[numSource];
+    for (n=0;(*p!=0)&&(n<63);p++) { // operands without spaces, split at the first comma outside ()
+      if ((*p==' ')||(*p=='\t')||(*p=='\n')||(*p=='\r')) continue;
+      if (*p=='(') depth++;
+      if (*p==')') depth--;
+      if ((*p==',')&&(depth==0)&&!second) {
+        *end=0;
+        end=sourceArg2[numSource];
+        second=1;
+        n=0;
+        continue;
+      }
+      *end++=((*p>='A')&&(*p<='Z'))?*p|32:*p;
+      n++;
+    }
+    *end=0;
+    numSource++;
+  }
+  fclose(file);
+  return numSource<MAXSOURCE;
+}
+
+// Returns the register (from B to A, or (IX+d) leaving d in *offset) named by
+// an operand, or -1
+int sourceRegister(char *arg,int *offset) {
+  for (int r=0;r<=_reg_a;r++) {
+    if (strcmp(arg,registerNames[r])==0) return r;
+  }
+  if ((strncmp(arg,"(ix",3)==0)&&(arg[strlen(arg)-1]==')')) {
+    if (strcmp(arg,"(ix)")==0) *offset=0;
+    else if ((arg[3]=='+')||(arg[3]=='-')) *offset=atoi(arg+3);
+    else return -1;
+    if ((*offset<-128)||(*offset>127)) return -1;
+    return _reg_ix_ind;
+  }
+  return -1;
+}
+
+// Returns the registers read for the value of an operand (or for its address
+// if it is in memory), as a mask of 1<<register and _live_flags
+int sourceReads(char *arg) {
+  for (int r=_reg_b;r<=_reg_a;r++) {
+    if ((r!=_reg_hl_ind)&&(strcmp(arg,registerNames[r])==0)) return 1<<r;
+  }
+  for (int p=_pair_bc;p<=_pair_hl;p++) {
+    if ((strcmp(arg,pairNames[p])==0)||((arg[0]=='(')&&(strncmp(arg+1,pairNames[p],2)==0)&&(arg[3]==')'))) return 3<<(p*2);
+  }
+  if (strcmp(arg,"af")==0) return (1<<_reg_a)|_live_flags;
+  return 0;
+}
+
+// Returns the registers written when an operand is the destination
+int sourceWrites(char *arg) {
+  if (arg[0]=='(') return 0;
+  return sourceReads(arg);
+}
+
+// Finds the registers read and written by an instruction of the source.
+// Returns 0 if the next line may not be the next one run (jumps, calls and
+// returns) or the instruction is not known.
+int sourceEffect(int i,int *reads,int *writes) {
+  char *op=sourceOp[i];
+  char *arg1=sourceArg1[i];
+  char *arg2=sourceArg2[i];
+  char *source;
+  int carry;
+  *reads=0;
+  *writes=0;
+  carry=(strcmp(op,"adc")==0)||(strcmp(op,"sbc")==0)||(strcmp(op,"rl")==0)||(strcmp(op,"rr")==0);
+  if (strcmp(op,"ld")==0) {
+    *reads=sourceReads(arg2)|((arg1[0]=='(')?sourceReads(arg1):0);
+    *writes=sourceWrites(arg1);
+  }
+  else if (strcmp(op,"push")==0) *reads=sourceReads(arg1);
+  else if (strcmp(op,"pop")==0) *writes=sourceWrites(arg1);
+  else if (strcmp(op,"ex")==0) *reads=sourceReads(arg1)|sourceReads(arg2)|((strcmp(arg1,"af")==0)?(1<<_reg_a)|_live_flags:0);
+  else if (strcmp(op,"exx")==0) *reads=0x3F;
+  else if ((strcmp(op,"add")==0)||(strcmp(op,"adc")==0)||(strcmp(op,"sub")==0)||(strcmp(op,"sbc")==0)
+         ||(strcmp(op,"and")==0)||(strcmp(op,"or")==0)||(strcmp(op,"xor")==0)||(strcmp(op,"cp")==0)) {
+    if ((arg2[0]!=0)&&(strcmp(arg1,"a")!=0)) { // 16 bits
+      *reads=sourceReads(arg1)|sourceReads(arg2)|(carry?_live_flags:0);
+      *writes=sourceWrites(arg1)|(carry?_live_flags:0);  // 'add hl' keeps the zero flag
+      return 1;
+    }
+    source=(arg2[0]!=0)?arg2:arg1;
+    *writes=_live_flags|((strcmp(op,"cp")==0)?0:1<<_reg_a);
+    if (((strcmp(op,"xor")==0)||(strcmp(op,"sub")==0))&&(strcmp(source,"a")==0)) return 1;  // A = 0
+    *reads=(1<<_reg_a)|sourceReads(source)|(carry?_live_flags:0);
+  }
+  else if ((strcmp(op,"inc")==0)||(strcmp(op,"dec")==0)) { // carry is kept
+    *reads=sourceReads(arg1);
+    *writes=sourceWrites(arg1);
+  }
+  else if ((strcmp(op,"neg")==0)||(strcmp(op,"daa")==0)) {
+    *reads=(1<<_reg_a)|((op[0]=='d')?_live_flags:0);
+    *writes=(1<<_reg_a)|_live_flags;
+  }
+  else if ((strcmp(op,"cpl")==0)||(strcmp(op,"rlca")==0)||(strcmp(op,"rrca")==0)) {
+    *reads=1<<_reg_a;
+    *writes=1<<_reg_a;
+  }
+  else if ((strcmp(op,"rla")==0)||(strcmp(op,"rra")==0)) {
+    *reads=(1<<_reg_a)|_live_flags;
+    *writes=1<<_reg_a;
+  }
+  else if ((strcmp(op,"rlc")==0)||(strcmp(op,"rrc")==0)||(strcmp(op,"rl")==0)||(strcmp(op,"rr")==0)||(strcmp(op,"sla")==0)
+         ||(strcmp(op,"sra")==0)||(strcmp(op,"srl")==0)||(strcmp(op,"sll")==0)||(strcmp(op,"sli")==0)) {
+    *reads=sourceReads(arg1)|(carry?_live_flags:0);
+    *writes=sourceWrites(arg1)|_live_flags;
+  }
+  else if ((strcmp(op,"bit")==0)||(strcmp(op,"set")==0)||(strcmp(op,"res")==0)) *reads=sourceReads(arg2);
+  else if (strcmp(op,"ccf")==0) *reads=_live_flags;
+  else if ((strcmp(op,"scf")!=0)&&(strcmp(op,"nop")!=0)&&(strcmp(op,"di")!=0)&&(strcmp(op,"ei")!=0)) return 0;
+  return 1;
+}
+
+// Returns the registers (and _live_flags) which the source from line first on
+// may read before writing them. The code is followed until a jump, call or
+// return, where all the registers not written yet are taken as read.
+// Leaves in *use the first line reading A, or -1.
+int liveAfter(int first,int *use) {
+  int unknown=0x3F|(1<<_reg_a)|_live_flags;
+  int live=0;
+  int reads;
+  int writes;
+  *use=-1;
+  for (int i=first;(i<numSource)&&(unknown!=0);i++) {
+    if (sourceKind[i]==_source_empty) continue;
+    if ((sourceKind[i]!=_source_code)||!sourceEffect(i,&reads,&writes)) return live|unknown;
+    if ((*use<0)&&(reads&unknown&(1<<_reg_a))) *use=i;
+    live|=reads&unknown;
+    unknown&=~(reads|writes);
+  }
+  return live|unknown;
+}
+
+// Returns the line with the next (or previous, if step is -1) instruction, or
+// -1 if there is a label in between or no instruction
+int nextInstruction(int i,int step) {
+  if ((step<0)&&(sourceLabel[i][0]!=0)) return -1;
+  for (i+=step;(i>=0)&&(i<numSource);i+=step) {
+    if ((step>0)&&(sourceLabel[i][0]!=0)) return -1;
+    if (sourceKind[i]==_source_code) return i;
+    if (sourceKind[i]!=_source_empty) return -1;
+    if ((step<0)&&(sourceLabel[i][0]!=0)) return -1;
+  }
+  return -1;
+}
+
+// Returns the time of the one line of code asmInstruction
+int oneLineTime(int asmInstruction,int op1,int op2) {
+  resetCode();
+  addLineOp(asmInstruction,op1,op2);
+  return lineTime(0);
+}
+
+// Prints a mask of registers and flags as "B, C and flags"
+void printLive(int live) {
+  char *names[]={"B","C","D","E","H","L","","A","flags"};
+  char *list[9];
+  int numNames=0;
+  if ((live>>_reg_a)&1) list[numNames++]=names[_reg_a];
+  for (int r=0;r<9;r++) {
+    if (((live>>r)&1)&&(r!=_reg_a)&&(r!=_reg_hl_ind)) list[numNames++]=names[r];
+  }
+  if (numNames==0) printf("nothing");
+  printRegisterList(list,numNames);
+}
+
+// Sets the options of the variant of a site, and builds and tests its code
+// (none if the site is -1). Returns its worst time.
+int buildSite(int site,float num,int div) {
+  operandIn=(site<0)?_reg_a:siteIn[site];
+  operandOut=(site<0)?_reg_a:siteOut[site];
+  ixOffset=(site<0)?0:siteIx[site];
+  sprintf(ixName,"(ix%+d)",ixOffset);
+  flagContract=(site<0)?0:siteFlags[site];
+  preserveMask=(site<0)?0:sitePreserve[site];
+  buildRoutine(num,div);
+  finishCode(num,div);
+  return timeWorst;
+}
+
+// Returns 1 if the code has no jumps and only one 'ret', at its end
+int isStraightCode(void) {
+  for (int i=0;i<numResultLines;i++) {
+    if ((resultLines[i]==_label)||(resultLines[i]==_jr_nc)||(resultLines[i]==_jr_c)||(resultLines[i]==_jr_z)||(resultLines[i]==_jr)
+        ||(resultLines[i]==_jp)||(resultLines[i]==_jp_hl)||((resultLines[i]==_ret)&&(i<numResultLines-1))) return 0;
+  }
+  return 1;
+}
+
+// Writes the name of the function of a site in text, leaving its code built
+void siteName(int site,char *text) {
+  char suffix[64];
+  if (siteDiv[site]!=0) sprintf(text,"fraction_%d_%d",(int)siteNum[site],siteDiv[site]);
+  else sprintf(text,"division_by_%g",siteNum[site]);
+  buildSite(site,siteNum[site],siteDiv[site]);
+  indexSuffix(suffix);
+  strcat(text,suffix);
+}
+
+// Finds the fastest variant of the function called at line i: reading its
+// input from the register loaded into A before the call, leaving the result
+// in the register it is moved to, or guaranteeing the flags tested by a
+// following 'or a', keeping the registers live after the call that the
+// function didn't change, and inlined if it has no jumps. The call costs 5
+// microseconds. Adds the site and prints it. Returns the microseconds saved.
+int findSite(char *file,int i,float num,int div) {
+  int site=numSites;
+  int prev=nextInstruction(i,-1);
+  int next=nextInstruction(i,1);
+  int inReg=-1;
+  int inIx=0;
+  int outReg=-1;
+  int flags=0;
+  int prevTime=0;
+  int nextTime=0;
+  int written[NUMREGISTERS];
+  int keep=0;
+  int live;
+  int use;
+  int time;
+  int original;
+  int best=-1;
+  int bestSize=0;
+  int bestIn=_reg_a;
+  int bestIx=0;
+  int bestOut=_reg_a;
+  int bestFlags=0;
+  int bestPreserve=0;
+  int bestInline=0;
+  int offset;
+  int after;
+  char name[64];
+  if ((prev>=0)&&(strcmp(sourceOp[prev],"ld")==0)&&(strcmp(sourceArg1[prev],"a")==0)) {
+    inReg=sourceRegister(sourceArg2[prev],&inIx);
+    if (inReg==_reg_a) inReg=-1;
+    if (inReg>=0) prevTime=oneLineTime(_ld_r_r,_reg_a,inReg);
+  }
+  if ((next>=0)&&(strcmp(sourceOp[next],"ld")==0)&&(strcmp(sourceArg2[next],"a")==0)) {
+    outReg=sourceRegister(sourceArg1[next],&offset);
+    if ((outReg==_reg_a)||(outReg==_reg_ix_ind)) outReg=-1;
+    if ((outReg>=0)&&((liveAfter(next+1,&use)>>_reg_a)&1)) outReg=-1;  // A is still needed
+    if (outReg>=0) nextTime=oneLineTime(_ld_r_r,outReg,_reg_a);
+  }
+  if ((next>=0)&&((strcmp(sourceOp[next],"or")==0)||(strcmp(sourceOp[next],"and")==0))&&(strcmp(sourceArg1[next],"a")==0)&&(sourceArg2[next][0]==0)) {
+    after=nextInstruction(next,1);
+    flags=_flag_z|_flag_s|_flag_nc;  // as 'or a', but the parity
+    if ((after>=0)&&((strcmp(sourceArg1[after],"pe")==0)||(strcmp(sourceArg1[after],"po")==0))) flags=0;
+    if (flags) nextTime=oneLineTime(_or_r,_reg_a,0);
+  }
+  siteNum[site]=num;
+  siteDiv[site]=div;
+  original=5+buildSite(-1,num,div);
+  findWritten(written);
+  for (int r=_reg_b;r<=_reg_l;r++) {
+    if (!written[r]) keep|=1<<r;
+  }
+  original+=prevTime+nextTime;
+  for (int in=0;in<2;in++) { // try each variant
+    for (int out=0;out<2;out++) {
+      if ((in&&(inReg<0))||(out&&(outReg<0)&&!flags)) continue;
+      siteIn[site]=in?inReg:_reg_a;
+      siteIx[site]=in?inIx:0;
+      siteOut[site]=(out&&(outReg>=0))?outReg:_reg_a;
+      siteFlags[site]=(out&&flags)?flags:0;
+      live=liveAfter(out?next+1:i+1,&use);
+      sitePreserve[site]=0;
+      time=buildSite(site,num,div);
+      findWritten(written);
+      for (int r=_reg_b;r<=_reg_l;r++) { // live registers the original function kept
+        if (written[r]&&((live&keep)>>r)&1&&(r!=siteOut[site])) sitePreserve[site]|=1<<r;
+      }
+      if (sitePreserve[site]!=0) time=buildSite(site,num,div);
+      siteInline[site]=isStraightCode();
+      time+=siteInline[site]?-3:5;  // 'ret', or 'call'
+      if (!in) time+=prevTime;
+      if (!out) time+=nextTime;
+      countCandidate(1);
+      if ((best<0)||(time<best)||((time==best)&&(sizeResult<bestSize))) {
+        best=time;
+        bestSize=sizeResult;
+        siteFirst[site]=in?prev:i;
+        siteCall[site]=i;
+        siteLast[site]=out?next:i;
+        bestIn=siteIn[site];
+        bestIx=siteIx[site];
+        bestOut=siteOut[site];
+        bestFlags=siteFlags[site];
+        bestPreserve=sitePreserve[site];
+        bestInline=siteInline[site];
+      }
+    }
+  }
+  siteIn[site]=bestIn;
+  siteIx[site]=bestIx;
+  siteOut[site]=bestOut;
+  siteFlags[site]=bestFlags;
+  sitePreserve[site]=bestPreserve;
+  siteInline[site]=bestInline;
+  live=liveAfter(i+1,&use);
+  printf(";; %s:%d  call %s\n",file,i+1,sourceArg1[i]);
+  printf(";;   Live after the call: ");
+  printLive(live);
+  if (use>=0) printf("\n;;   Result used at line %d: %s %s%s%s\n",use+1,sourceOp[use],sourceArg1[use],sourceArg2[use][0]?",":"",sourceArg2[use]);
+  else printf("\n;;   Result use not known\n");
+  if (best>=original) {
+    printf(";;   No faster variant (%d microseconds)\n;;\n",original);
+    return 0;
+  }
+  siteName(site,name);
+  if (siteInline[site]) printf(";;   Inlined %s",name);
+  else printf(";;   Calls %s",name);
+  if (siteFirst[site]!=siteLast[site]) printf(" (lines %d to %d)",siteFirst[site]+1,siteLast[site]+1);
+  printf("\n;;   %d -> %d microseconds (%d saved)\n;;\n",original,best,original-best);
+  numSites++;
+  return original-best;
+}
+
+// Writes the source back to its file, replacing the sites from first on
+// with their variants
+void writeSource(char *name,int first) {
+  FILE *file;
+  char indent[256];
+  int site=first;
+  int n;
+  file=fopen(name,"w");
+  if (file==NULL) {
+    printf(";;---ERROR can't write %s---\n",name);
+    return;
+  }
+  for (int i=0;i<numSource;i++) {
+    if ((site>=numSites)||(i<siteFirst[site])) {
+      fputs(sourceText[i],file);
+      continue;
+    }
+    if (i!=siteCall[site]) { // removed line, keeping its label
+      if (sourceLabel[i][0]!=0) fprintf(file,"%s\n",sourceLabel[i]);
+    }
+    else {
+      n=strspn(sourceText[i]," \t");
+      if (sourceLabel[i][0]!=0) { // label on its own line, same indent for the code
+        fprintf(file,"%s\n",sourceLabel[i]);
+        n=strstr(sourceText[i],sourceOp[i])-sourceText[i];
+      }
+      for (int k=0;k<n;k++) indent[k]=(sourceText[i][k]=='\t')?'\t':' ';
+      indent[n]=0;
+      siteName(site,indent+n+1);  // name after the indent
+      if (siteInline[site]) {
+        fprintf(file,"%s; %s (inlined by amdivgen)\n",indent,indent+n+1);
+        numResultLines--;  // without 'ret'
+        writeLines(file,indent);
+      }
+      else fprintf(file,"%scall %s\n",indent,indent+n+1);
+    }
+    if (i==siteLast[site]) site++;
+  }
+  fclose(file);
+}
+
+// Scans assembly sources for calls to division and fraction functions,
+// finding the fastest variant for each call, and prints the report and the
+// variants which are called. The sources are only changed if rewrite is set.
+void callSites(int numFiles,char **files,int rewrite) {
+  char name[64];
+  char other[64];
+  int written[NUMREGISTERS];
+  float num;
+  int div;
+  int totalSites=0;
+  int saved=0;
+  int first;
+  int repeated;
+  int n;
+  numSites=0;
+  printf(";;\n;; Call sites\n;;\n");
+  for (int f=0;f<numFiles;f++) {
+    if (!readSource(files[f])) {
+      printf(";;---ERROR can't read %s (or it is too big)---\n",files[f]);
+      continue;
+    }
+    first=numSites;
+    for (int i=0;(i<numSource)&&(numSites<MAXSITES);i++) {
+      if ((sourceKind[i]!=_source_code)||(strcmp(sourceOp[i],"call")!=0)||(sourceArg2[i][0]!=0)) continue;
+      n=0;
+      div=0;
+      if (strncmp(sourceArg1[i],"division_by_",12)==0) {
+        if ((sscanf(sourceArg1[i]+12,"%f%n",&num,&n)!=1)||(sourceArg1[i][12+n]!=0)||(num<1)) continue;
+      }
+      else if (strncmp(sourceArg1[i],"fraction_",9)==0) {
+        if ((sscanf(sourceArg1[i]+9,"%f_%d%n",&num,&div,&n)!=2)||(sourceArg1[i][9+n]!=0)) continue;
+        if ((num<1)||(num>div)||(num!=(int)num)||(isPowerOf2(div)==0)) continue;
+      }
+      else continue;
+      totalSites++;
+      saved+=findSite(files[f],i,num,div);
+    }
+    if (rewrite&&(numSites>first)) writeSource(files[f],first);
+  }
+  printf(";; %d calls in %d files, %d microseconds saved%s\n",totalSites,numFiles,saved,rewrite?" (files rewritten)":"");
+  for (int site=0;site<numSites;site++) { // each called variant once
+    if (siteInline[site]) continue;
+    siteName(site,name);
+    repeated=0;
+    for (int k=0;k<site;k++) {
+      if (siteInline[k]) continue;
+      siteName(k,other);
+      if (strcmp(name,other)==0) repeated=1;
+    }
+    if (repeated) continue;
+    findWritten(written);
+    siteName(site,name);
+    printHeader(siteNum[site],sizeResult,timeWorst,written[_reg_b]?_destroys_b:_only_use_a,siteDiv[site]);
+    printlines();
+  }
+}
+
+// Main function
+int main(int argc, char **argv) {
+  float num;
+  float param1;
+  float param2;
+  int numArgs=1;
+  for (int i=1;i<argc;i++) { // read options and remove them from the arguments
+    if (strncmp(argv[i],"--index=",8)==0) {
+      if (strcmp(argv[i]+8,"hl")==0) indexMode=_index_hl;
+      else if (strcmp(argv[i]+8,"de")==0) indexMode=_index_de;
+      else if (strcmp(argv[i]+8,"page")==0) indexMode=_index_page;
+      else {
+        printf("Index must be hl, de or page.\n");
+        return 1;
+      }
+    }
+    else if ((strncmp(argv[i],"--in=",5)==0)||(strncmp(argv[i],"--out=",6)==0)) {
+      char *text=strchr(argv[i],'=')+1;
+      int reg=-1;
+      for (int r=0;r<=_reg_a;r++) {
+        if (strcmp(text,registerNames[r])==0) reg=r;
+      }
+      if ((strncmp(text,"(ix",3)==0)&&((text[3]=='+')||(text[3]=='-'))&&(text[strlen(text)-1]==')')) {
+        ixOffset=atoi(text+3);
+        if ((ixOffset<-128)||(ixOffset>127)) {
+          printf("Index offset must be between -128 and 127.\n");
+          return 1;
+        }
+        sprintf(ixName,"(ix%+d)",ixOffset);
+        reg=_reg_ix_ind;
+      }
+      if (reg<0) {
+        printf("Operand must be a, b, c, d, e, h, l, (hl) or (ix+n).\n");
+        return 1;
+      }
+      if (argv[i][2]=='i') operandIn=reg;
+      else operandOut=reg;
+    }
+    else if (strncmp(argv[i],"--preserve=",11)==0) {
+      for (char *text=argv[i]+11;*text!=0;text++) {
+        int reg=-1;
+        for (int r=_reg_b;r<=_reg_l;r++) {
+          if (*text==registerNames[r][0]) reg=r;
+        }
+        if (reg<0) {
+          printf("Preserved registers must be b, c, d, e, h or l.\n");
+          return 1;
+        }
+        preserveMask|=1<<reg;
+      }
+    }
+    else if (strncmp(argv[i],"--flags=",8)==0) {
+      char *text=argv[i]+8;
+      while (*text!=0) {
+        if (strncmp(text,"nc",2)==0) { flagContract|=_flag_nc; text+=2; }
+        else if (*text=='z') { flagContract|=_flag_z; text++; }
+        else if (*text=='s') { flagContract|=_flag_s; text++; }
+        else {
+          printf("Flags must be z, s or nc (i.e. --flags=z,nc).\n");
+          return 1;
+        }
+        if (*text==',') text++;
+      }
+    }
+    else if (strcmp(argv[i],"--undocumented")==0) {
+      undocumented=1;
+    }
+    else if (strncmp(argv[i],"--threads=",10)==0) {
+      numThreads=atoi(argv[i]+10);
+      if ((numThreads<1)||(numThreads>64)) {
+        printf("Threads must be between 1 and 64.\n");
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i],"--stats")==0) {
+      if (!statsEnabled) atexit(printStats);
+      statsEnabled=1;
+    }
+    else if (strncmp(argv[i],"--scale=",8)==0) {
+      indexScale=atoi(argv[i]+8);
+      if ((indexScale!=1)&&(indexScale!=2)&&(indexScale!=4)&&(indexScale!=8)) {
+        printf("Scale must be 1, 2, 4 or 8.\n");
+        return 1;
+      }
+    }
+    else {
+      argv[numArgs]=argv[i];
+      numArgs++;
+    }
+  }
+  argc=numArgs;
+  if (argc==1) {
+    printHelp();
+    return 1;
+  }
+  if (((operandIn!=_reg_a)||(operandOut!=_reg_a))&&(indexMode!=_index_none)) {
+    printf("Options --in and --out can't be used with --index.\n");
+    return 1;
+  }
+  if ((flagContract!=0)&&(indexMode!=_index_none)) {
+    printf("Option --flags can't be used with --index.\n");
+    return 1;
+  }
+  if ((preserveMask!=0)&&(indexMode!=_index_none)) {
+    printf("Option --preserve can't be used with --index.\n");
+    return 1;
+  }
+  if ((operandOut<=_reg_l)&&((preserveMask>>operandOut)&1)) {
+    printf("The output register can't be preserved.\n");
+    return 1;
+  }
+  if ((indexScale>1)&&(indexMode==_index_none)) {
+    printf("Scale needs an index register (--index=hl, --index=de or --index=page).\n");
+    return 1;
+  }
+  if (preserveMask!=0) { // only division and fraction functions keep registers
+    char *fixedRegisters[]={"divisible","multiply","long","variable","inverse","sites","level",
+                            "carry","decimal","fixed","blend","multi","screen"};
+    for (int i=0;i<13;i++) {
+      if (strcmp(argv[1],fixedRegisters[i])==0) {
+        printf("Option --preserve can't be used with %s.\n",argv[1]);
+        return 1;
+      }
+    }
+  }
+  if (strcmp(argv[1],"divisible")==0) {
+    if (argc!=3) {
+      printHelp();
+      return 1;
+    }
+    if ((atoi(argv[2])<2)||(atoi(argv[2])>255)||(atoi(argv[2])!=atof(argv[2]))) {
+      printf("Divisor must be an integer between 2 and 255.\n");
+      return 1;
+    }
+    divisibilityTest(atoi(argv[2]));
+    return 0;
+  }
+  if (strcmp(argv[1],"multiply")==0) {
+    if ((argc<3)||(argc>4)||((argc==4)&&(atoi(argv[3])!=8)&&(atoi(argv[3])!=16))) {
+      printHelp();
+      return 1;
+    }
+    if ((atoll(argv[2])<1)||(atoll(argv[2])>65535)||(atoll(argv[2])!=atof(argv[2]))) {
+      printf("Multiplier must be an integer between 1 and 65535.\n");
+      return 1;
+    }
+    constantMultiply(atoll(argv[2]),(argc==4)?atoi(argv[3]):16);
+    return 0;
+  }
+  if (strcmp(argv[1],"long")==0) {
+    long long n;
+    int bits;
+    if (argc!=4) {
+      printHelp();
+      return 1;
+    }
+    n=atoll(argv[2]);
+    bits=atoi(argv[3]);
+    if ((bits!=16)&&(bits!=24)&&(bits!=32)) {
+      printf("Dividend size must be 16, 24 or 32 bits.\n");
+      return 1;
+    }
+    if ((n<2)||(n!=atof(argv[2]))||(n>=((long long)1<<bits))) {
+      printf("Divisor must be an integer between 2 and 2^%d-1.\n",bits);
+      return 1;
+    }
+    while ((n>255)&&((n&1)==0)) n>>=1;
+    if (n>255) {
+      printf("Divisors above 255 must be an odd number up to 255 times a power of 2.\n");
+      return 1;
+    }
+    longDivision(atoll(argv[2]),bits);
+    return 0;
+  }
+  if (strcmp(argv[1],"scale")==0) {
+    double f;
+    double maxError=1;
+    if ((argc<3)||(argc>4)) {
+      printHelp();
+      return 1;
+    }
+    f=atof(argv[2]);
+    if (argc==4) maxError=atof(argv[3]);
+    if ((f<=0)||(f>1)) {
+      printf("Factor must be greater than 0 and up to 1.\n");
+      return 1;
+    }
+    if (maxError<=0) {
+      printf("Allowed error must be greater than 0.\n");
+      return 1;
+    }
+    scaleFactor(f,maxError);
+    return 0;
+  }
+  if (strcmp(argv[1],"variable")==0) {
+    int maxA,minB,maxB;
+    if ((argc<5)||(argc>6)||((argc==6)&&(strcmp(argv[5],"mod")!=0))) {
+      printHelp();
+      return 1;
+    }
+    maxA=atoi(argv[2]);
+    minB=atoi(argv[3]);
+    maxB=atoi(argv[4]);
+    if ((maxA<1)||(maxA>255)) {
+      printf("Maximum dividend must be between 1 and 255.\n");
+      return 1;
+    }
+    if ((minB<1)||(minB>maxB)||(maxB>255)) {
+      printf("Divisor range must be between 1 and 255.\n");
+      return 1;
+    }
+    variableDivision(maxA,minB,maxB,argc==6);
+    return 0;
+  }
+  if (strcmp(argv[1],"split")==0) {
+    long long weights[256];
+    FILE *file;
+    if ((argc<3)||(argc>5)||((argc>3)&&(strcmp(argv[3],"average")!=0))) {
+      printHelp();
+      return 1;
+    }
+    if (atof(argv[2])<1) {
+      printf("Divisor must be greater than or equal to 1.\n");
+      return 1;
+    }
+    for (int j=0;j<256;j++) weights[j]=1;
+    if (argc==5) {
+      file=fopen(argv[4],"r");
+      if (file==NULL) {
+        printf("Can't read profile %s.\n",argv[4]);
+        return 1;
+      }
+      for (int j=0;j<256;j++) {
+        if ((fscanf(file,"%lld",&weights[j])!=1)||(weights[j]<0)) {
+          printf("Profile must have 256 positive weights.\n");
+          fclose(file);
+          return 1;
+        }
+      }
+      fclose(file);
+    }
+    splitDivision(atof(argv[2]),argc>3,weights,argc==5);
+    return 0;
+  }
+  if (strcmp(argv[1],"inverse")==0) {
+    long long k;
+    int maxSize=0;
+    if ((argc<3)||(argc>4)) {
+      printHelp();
+      return 1;
+    }
+    k=atoll(argv[2]);
+    if ((k<1)||(k>65535)||(k!=atof(argv[2]))) {
+      printf("Dividend must be an integer between 1 and 65535.\n");
+      return 1;
+    }
+    if (argc==4) {
+      maxSize=atoi(argv[3]);
+      if (maxSize<1) {
+        printf("Maximum size must be greater than 0.\n");
+        return 1;
+      }
+    }
+    inverseDivision(k,maxSize);
+    return 0;
+  }
+  if (strcmp(argv[1],"sites")==0) {
+    int rewrite=(strcmp(argv[argc-1],"rewrite")==0);
+    if (argc-rewrite<3) {
+      printHelp();
+      return 1;
+    }
+    callSites(argc-2-rewrite,argv+2,rewrite);
+    return 0;
+  }
+  if (strcmp(argv[1],"level")==0) {
+    int k;
+    if ((argc<3)||(argc>4)||((argc==4)&&(strcmp(argv[3],"round")!=0))) {
+      printHelp();
+      return 1;
+    }
+    k=isPowerOf2(atoi(argv[2]))-1;
+    if ((k<1)||(k>7)||(atoi(argv[2])!=atof(argv[2]))) {
+      printf("Levels must be a power of 2 between 2 and 128.\n");
+      return 1;
+    }
+    levelFraction(k,argc==4);
+    return 0;
+  }
+  if (strcmp(argv[1],"carry")==0) {
+    if (argc!=3) {
+      printHelp();
+      return 1;
+    }
+    if (atof(argv[2])<2) {
+      printf("Divisor must be greater than or equal to 2.\n");
+      return 1;
+    }
+    nineBitDivision(atof(argv[2]));
+    return 0;
+  }
+  if (strcmp(argv[1],"decimal")==0) {
+    if ((argc<3)||(argc>4)||((argc==4)&&(strcmp(argv[3],"bcd")!=0)&&(strcmp(argv[3],"ascii")!=0))) {
+      printHelp();
+      return 1;
+    }
+    if ((atoi(argv[2])!=8)&&(atoi(argv[2])!=16)) {
+      printf("Input size must be 8 or 16 bits.\n");
+      return 1;
+    }
+    decimalConversion(atoi(argv[2]),(argc==4)&&(strcmp(argv[3],"ascii")==0));
+    return 0;
+  }
+  if (strcmp(argv[1],"fixed")==0) {
+    if ((argc<3)||((argc==4)&&(strcmp(argv[3],"round")!=0))||(argc>4)) {
+      printHelp();
+      return 1;
+    }
+    if (atof(argv[2])<1) {
+      printf("Divisor must be greater than or equal to 1.\n");
+      return 1;
+    }
+    fixedDivision(atof(argv[2]),argc==4);
+    return 0;
+  }
+  if (strcmp(argv[1],"blend")==0) {
+    int weights[3];
+    int k;
+    if ((argc<5)||(argc>6)) {
+      printHelp();
+      return 1;
+    }
+    k=isPowerOf2(atoi(argv[2]))-1;
+    if (k<0) {
+      printf("Divisor must be a power of 2.\n");
+      return 1;
+    }
+    for (int i=3;i<argc;i++) {
+      weights[i-3]=atoi(argv[i]);
+      if ((weights[i-3]<0)||(weights[i-3]!=atof(argv[i]))) {
+        printf("Weights must be positive integers.\n");
+        return 1;
+      }
+    }
+    if ((weights[0]==0)&&(weights[1]==0)&&((argc==5)||(weights[2]==0))) {
+      printf("At least one weight must be greater than 0.\n");
+      return 1;
+    }
+    linearBlend(argc-3,weights,k);
+    return 0;
+  }
+  if (strcmp(argv[1],"multi")==0) {
+    char *separator;
+    int reg;
+    int usedRegs[8]={0};
+    if ((argc<4)||(argc>MAXTARGETS+2)) {
+      printf("Between 2 and %d results are needed.\n",MAXTARGETS);
+      return 1;
+    }
+    numTargets=0;
+    for (int i=2;i<argc;i++) {
+      reg=(i==2)?_reg_a:-1;
+      separator=strchr(argv[i],':');
+      if (separator!=NULL) {
+        *separator=0;
+        for (reg=0;(reg<8)&&(strcmp(registerNames[reg],separator+1)!=0);reg++);
+        if ((reg==8)||(reg==_reg_b)||(reg==_reg_hl_ind)) {
+          printf("Result register must be a, c, d, e, h or l.\n");
+          return 1;
+        }
+      }
+      targetReg[numTargets]=reg;
+      separator=strchr(argv[i],'/');
+      if (separator!=NULL) {
+        *separator=0;
+        targetNum[numTargets]=atoi(argv[i]);
+        targetDiv[numTargets]=atoi(separator+1);
+        if ((isPowerOf2(targetDiv[numTargets])==0)||(targetNum[numTargets]<0)||(targetNum[numTargets]>targetDiv[numTargets])) {
+          printf("Fractions must be num1/num2, where num2 is a power of 2 and num1<=num2.\n");
+          return 1;
+        }
+      }
+      else {
+        targetNum[numTargets]=atof(argv[i]);
+        targetDiv[numTargets]=0;
+        if (targetNum[numTargets]<1) {
+          printf("Divisor must be greater than or equal to 1.\n");
+          return 1;
+        }
+      }
+      if (reg>=0) usedRegs[reg]=1;
+      numTargets++;
+    }
+    for (int t=0;t<numTargets;t++) { // give a free register to results without one
+      int order[]={_reg_c,_reg_d,_reg_e,_reg_h,_reg_l};
+      for (int k=0;(k<5)&&(targetReg[t]<0);k++) {
+        if (!usedRegs[order[k]]) {
+          targetReg[t]=order[k];
+          usedRegs[order[k]]=1;
+        }
+      }
+    }
+    targetsUseB=0;
+    multipleResults();
+    return 0;
+  }
+  if (strcmp(argv[1],"batch")==0) {
+    char *separator;
+    if ((argc<3)||(argc>MAXREQUESTS+2)) {
+      printf("Between 1 and %d requests are needed.\n",MAXREQUESTS);
+      return 1;
+    }
+    numRequests=0;
+    for (int i=2;i<argc;i++) {
+      separator=strchr(argv[i],'/');
+      if (separator!=NULL) {
+        *separator=0;
+        requestNum[numRequests]=atoi(argv[i]);
+        requestDiv[numRequests]=atoi(separator+1);
+        if ((isPowerOf2(requestDiv[numRequests])==0)||(requestNum[numRequests]<0)||(requestNum[numRequests]>requestDiv[numRequests])) {
+          printf("Fractions must be num1/num2, where num2 is a power of 2 and num1<=num2.\n");
+          return 1;
+        }
+      }
+      else {
+        requestNum[numRequests]=atof(argv[i]);
+        requestDiv[numRequests]=0;
+        if (requestNum[numRequests]<1) {
+          printf("Divisor must be greater than or equal to 1.\n");
+          return 1;
+        }
+      }
+      if ((indexMode==_index_page)&&(expectedResult(requestNum[numRequests],requestDiv[numRequests],255)*indexScale>255)) {
+        printf("Scaled result does not fit in the 256 byte page.\n");
+        return 1;
+      }
+      numRequests++;
+    }
+    batchRoutines();
+    return 0;
+  }
+  if (strcmp(argv[1],"screen")==0) {
+    int mode,maxX;
+    if (argc<3) {
+      printHelp();
+      return 1;
+    }
+    mode=atoi(argv[2]);
+    if ((mode<0)||(mode>2)) {
+      printf("Screen mode must be 0, 1 or 2.\n");
+      return 1;
+    }
+    maxX=(160<<mode)-1;
+    if ((argc>3)&&(strcmp(argv[3],"hl")!=0)) maxX=atoi(argv[3]);
+    if ((maxX<1)||(maxX>(160<<mode)-1)) {
+      printf("Maximum x must be between 1 and %d for mode %d.\n",(160<<mode)-1,mode);
+      return 1;
+    }
+    screenAddress(mode,maxX,strcmp(argv[argc-1],"hl")==0);
+    return 0;
+  }
+  param1=atof(argv[1]);
+  if (argc>2) {
+    param2=atof(argv[2]);
+    if (param1==0) {
+      if (param2<1) {
+        printf("Divisor must be greater than or equal to 1.\n");
+        return 1;
+      }
+      showInfo(param2);
+    }
+    else {
+      num=isPowerOf2(param2);
+      if (num==0) {
+        printf("Divisor must be a power of 2.\n");
+        return 1;
+      }
+      if ((param1!=atoi(argv[1]))||(param1<0)) {
+        printf("Dividend must be a positive integer.\n");
+        return 1;
+      }
+      if (param1>param2) {
+        if (param1>257) {
+          printf("Dividend of a fraction above 1 must be at most 257.\n");
+          return 1;
+        }
+        if (argc>3) {
+          if (strcmp(argv[3],"hl")==0) fractionResult=_result_hl;
+          else if (strcmp(argv[3],"saturate")==0) fractionResult=_result_saturate;
+          else if (strcmp(argv[3],"wrap")==0) fractionResult=_result_wrap;
+          else {
+            printf("Result must be hl, saturate or wrap.\n");
+            return 1;
+          }
+        }
+        if ((indexMode!=_index_none)||(operandIn!=_reg_a)||(operandOut!=_reg_a)) {
+          printf("Options --index, --in and --out can't be used with fractions above 1.\n");
+          return 1;
+        }
+        if ((fractionResult==_result_hl)&&((flagContract!=0)||(preserveMask&((1<<_reg_h)|(1<<_reg_l))))) {
+          printf("A result in HL can't have --flags or keep H and L.\n");
+          return 1;
+        }
+      }
+      if ((indexMode==_index_page)&&(expectedResult(param1,param2,255)*indexScale>255)) {
+        printf("Scaled result does not fit in the 256 byte page.\n");
+        return 1;
+      }
+      generateCode(param1,param1,param2,num-1);
+    }
+  }
+  else {
+    num=param1;
+    if ((num>=1)&&(indexMode==_index_page)&&(expectedResult(num,0,255)*indexScale>255)) {
+      printf("Scaled result does not fit in the 256 byte page.\n");
+      return 1;
+    }
+    if ((num<=-1)&&(indexMode==_index_page)&&(expectedResult(-num,0,255)*indexScale>255)) {
+      printf("Scaled result does not fit in the 256 byte page.\n");
+      return 1;
+    }
+    if (num<=-1){
+      findApproximation(-num);
+    }
+    else if (num<1) {
+      printf("Divisor must be greater than or equal to 1.\n");
+      return 1;
+    }
+    else {
+      divisionRoutine(num);
     }
-    else {
-      findApproximation(num);}
   }
   return 0;
 }